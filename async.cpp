@@ -0,0 +1,148 @@
+#include "async.hpp"
+
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+AsyncEvaluator::AsyncEvaluator(Calculator* calc, QalculateMutex& calc_lock, PlotTarget& plot)
+    : calc(calc), calc_lock(calc_lock), plot(plot) {
+    if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        pipe_fds[0] = pipe_fds[1] = -1;
+    }
+    worker = std::thread(&AsyncEvaluator::run, this);
+}
+
+AsyncEvaluator::~AsyncEvaluator() {
+    stop();
+    for (AsyncResult& res : finished) {
+        delete res.expr;
+        delete res.parsed_src;
+    }
+
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+}
+
+std::optional<AsyncJob> AsyncEvaluator::submit(AsyncJob job) {
+    std::lock_guard<std::mutex> state(state_lock);
+
+    std::optional<AsyncJob> dropped = std::move(queued);
+    queued = std::move(job);
+    if (busy) {
+        calc->abort();
+    }
+
+    wake.notify_one();
+    return dropped;
+}
+
+std::optional<AsyncResult> AsyncEvaluator::next() {
+    std::lock_guard<std::mutex> state(state_lock);
+    if (finished.empty()) {
+        return std::nullopt;
+    }
+
+    AsyncResult res = std::move(finished.front());
+    finished.erase(finished.begin());
+    if (finished.empty()) {
+        // the worker writes while holding state_lock, so every byte
+        // still in the pipe belongs to a result that was already taken
+        char buf[64];
+        while (read(pipe_fds[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+
+    return res;
+}
+
+size_t AsyncEvaluator::pending() {
+    std::lock_guard<std::mutex> state(state_lock);
+    return queued.has_value() + busy + finished.size();
+}
+
+void AsyncEvaluator::stop() {
+    {
+        std::lock_guard<std::mutex> state(state_lock);
+        if (stopping) {
+            return;
+        }
+
+        stopping = true;
+        if (busy) {
+            calc->abort();
+        }
+        if (queued.has_value()) {
+            finished.push_back({queued->callback, true, queued->assigns, queued->precision, NULL, NULL, {}, {}});
+            queued.reset();
+        }
+    }
+
+    wake.notify_one();
+    worker.join();
+}
+
+void AsyncEvaluator::run() {
+    std::unique_lock<std::mutex> state(state_lock);
+    while (true) {
+        wake.wait(state, [this] { return stopping || queued.has_value(); });
+        if (stopping) {
+            return;
+        }
+
+        AsyncJob job = std::move(queued.value());
+        queued.reset();
+        busy = true;
+        state.unlock();
+
+        AsyncResult res = evaluate(job);
+
+        state.lock();
+        busy = false;
+        res.superseded = queued.has_value() || stopping;
+        finished.push_back(std::move(res));
+
+        char byte = 0;
+        if (write(pipe_fds[1], &byte, 1) < 0) {
+            // the pipe is full, which means there are plenty of wakeups pending already
+        }
+    }
+}
+
+AsyncResult AsyncEvaluator::evaluate(AsyncJob const& job) {
+    // stop() may be called while the main thread holds calc_lock, e.g. when another
+    // calculator's eval collects this one, so waiting for it must give up on stopping
+    std::unique_lock<QalculateMutex> guard(calc_lock, std::defer_lock);
+    while (!guard.try_lock_for(std::chrono::milliseconds(10))) {
+        std::lock_guard<std::mutex> state(state_lock);
+        if (stopping) {
+            return {job.callback, true, job.assigns, job.precision, NULL, NULL, {}, {}};
+        }
+    }
+
+    AsyncResult res = {job.callback, false, job.assigns, job.precision, new MathStructure, new MathStructure, {}, {}};
+    if (job.prepare) {
+        job.prepare();
+    }
+    plot.deferred = &res.plots;
+
+    calc->startControl();
+    {
+        // an abort() that came in before startControl() was lost
+        std::lock_guard<std::mutex> state(state_lock);
+        if (queued.has_value() || stopping) {
+            calc->abort();
+        }
+    }
+
+    *res.expr = calc->calculate(job.expr, job.eopts, res.parsed_src);
+    calc->stopControl();
+    plot.deferred = NULL;
+    if (job.finish) {
+        job.finish();
+    }
+
+    res.messages = collect_messages(calc);
+    return res;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <libqalculate/Calculator.h>
+#include <libqalculate/MathStructure.h>
+#include <libqalculate/includes.h>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "function.hpp"
+#include "util.hpp"
+
+struct AsyncJob {
+    std::string expr;
+    EvaluationOptions eopts;
+    int callback; // registry reference, only ever touched on the main thread
+    bool assigns; // may define variables
+    int precision; // calculated with, passed on to the result
+    // runs on the worker with the calculator locked, right before the calculation
+    std::function<void()> prepare;
+    // runs on the worker with the calculator still locked, right after the calculation
+    std::function<void()> finish;
+};
+
+struct AsyncResult {
+    int callback;
+    // a newer job was submitted while this one ran, nobody wants the result
+    bool superseded;
+    bool assigns; // copied from the job, the caller invalidates what depended on the old values
+    int precision; // copied from the job
+
+    MathStructure* expr;       // owned, nullable
+    MathStructure* parsed_src; // owned, nullable
+    MessageList messages;
+    std::vector<PlotData> plots;
+};
+
+// Runs calculations for one Calculator on a worker thread.
+// Every finished job writes a byte to a pipe, so the main loop can poll fd()
+// and pick the results up with next().
+class AsyncEvaluator {
+  public:
+    // calc_lock is held by the worker while it uses the calculator,
+    // every other thread has to lock it before touching any calculator.
+    // plot is the calculator's, the worker defers plots to the result.
+    AsyncEvaluator(Calculator* calc, QalculateMutex& calc_lock, PlotTarget& plot);
+    ~AsyncEvaluator();
+
+    int fd() const { return pipe_fds[0]; }
+
+    // queues a job and aborts the one currently running.
+    // Returns a queued job that never started, its callback is left to the caller.
+    std::optional<AsyncJob> submit(AsyncJob job);
+
+    // the oldest finished job, if any
+    std::optional<AsyncResult> next();
+
+    // jobs that are queued, running or finished but not yet taken by next()
+    size_t pending();
+
+    // aborts and joins the worker, unfinished jobs are reported as superseded
+    void stop();
+
+  private:
+    void run();
+    AsyncResult evaluate(AsyncJob const& job);
+
+    Calculator* calc;
+    QalculateMutex& calc_lock;
+    PlotTarget& plot;
+    std::thread worker;
+
+    std::mutex state_lock; // guards all members below
+    std::condition_variable wake;
+    std::optional<AsyncJob> queued;
+    std::vector<AsyncResult> finished;
+    bool busy = false;
+    bool stopping = false;
+
+    int pipe_fds[2];
+};
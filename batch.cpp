@@ -0,0 +1,17 @@
+#include "batch.hpp"
+
+std::vector<BatchResult> evaluate_batch(Calculator* calc, std::vector<std::string> const& exprs,
+                                        BatchCalculate const& calculate, bool keep_parsed) {
+    // messages of earlier calculations are not the first expression's
+    calc->clearMessages();
+
+    std::vector<BatchResult> results;
+    results.reserve(exprs.size());
+    for (std::string const& expr : exprs) {
+        MathStructure* parsed = keep_parsed ? new MathStructure : NULL;
+        MessageList messages;
+        MathStructure* res = new MathStructure(calculate(expr, parsed, messages));
+        results.push_back({res, parsed, std::move(messages)});
+    }
+    return results;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <libqalculate/Calculator.h>
+#include <libqalculate/MathStructure.h>
+#include <functional>
+#include <libqalculate/includes.h>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+struct BatchResult {
+    MathStructure* expr;       // owned
+    MathStructure* parsed_src; // owned, nullable
+    MessageList messages;
+};
+
+// calculates one expression, writing its parsed form to parsed if that is not NULL
+typedef std::function<MathStructure(std::string const& expr, MathStructure* parsed, MessageList& messages)>
+    BatchCalculate;
+
+// Calculates every expression in exprs with calculate, in order of the results.
+// The parsed expressions are kept if keep_parsed is set.
+//
+// The expressions are calculated one after another. libqalculate reaches its
+// calculator through the process wide CALCULATOR global, also from MathStructure
+// and Number arithmetic, so a Calculator per thread would still share that one
+// global and its messages, precision and abort state. Running them side by side
+// is not possible without changes to libqalculate.
+// Call with the calculator locked.
+std::vector<BatchResult> evaluate_batch(Calculator* calc, std::vector<std::string> const& exprs,
+                                        BatchCalculate const& calculate, bool keep_parsed);
@@ -0,0 +1,252 @@
+-- Benchmarks the module without Neovim.
+--   luajit bench/bench.lua [scale] [output]
+-- scale multiplies the iteration counts (default 1), output receives one JSON
+-- object per measurement (default bench_output.txt) for comparing runs.
+package.cpath = "./lua/?.so;" .. package.cpath
+
+local qalc = require("qalculate.qalc")
+local ffi = require("ffi")
+
+ffi.cdef([[
+typedef struct { long tv_sec; long tv_nsec; } bench_timespec;
+int clock_gettime(int clk_id, bench_timespec* tp);
+]])
+
+local CLOCK_MONOTONIC = 1
+local ts = ffi.new("bench_timespec")
+
+local function now_ms()
+    ffi.C.clock_gettime(CLOCK_MONOTONIC, ts)
+    return tonumber(ts.tv_sec) * 1e3 + tonumber(ts.tv_nsec) / 1e6
+end
+
+-- VmRSS and VmHWM (peak) of this process in kB
+local function memory()
+    local rss, peak = 0, 0
+    local f = io.open("/proc/self/status")
+    if f then
+        for line in f:lines() do
+            local key, kb = line:match("^(%w+):%s+(%d+) kB")
+            if key == "VmRSS" then
+                rss = tonumber(kb)
+            elseif key == "VmHWM" then
+                peak = tonumber(kb)
+            end
+        end
+        f:close()
+    end
+    return rss, peak
+end
+
+local scale = tonumber(arg[1]) or 1
+local output = arg[2] or "bench_output.txt"
+
+local function iterations(n)
+    return math.max(1, math.floor(n * scale))
+end
+
+local corpus = {
+    arithmetic = { "1 + 2 * 3", "2^100 / 7", "sqrt(2) * sqrt(8)", "(1 + 1/3)^12", "sin(pi/7) + cos(pi/7)" },
+    units = { "5 km to mi", "60 mph to m/s", "3 kWh to J", "1 lightyear to km" },
+    currency = { "10 USD to EUR", "250 GBP to JPY" },
+    symbolic = { "integrate(x^2 sin(x), x)", "integrate(200x * pi^x)", "diff(sin(x) cos(x), x)" },
+    matrix = {
+        "[[1, 2], [3, 4]] * [[5, 6], [7, 8]]",
+        "det([[1, 2, 3], [4, 5, 6], [7, 8, 10]])",
+        "inverse([[2, 1], [1, 3]])",
+    },
+}
+local categories = { "arithmetic", "units", "currency", "symbolic", "matrix" }
+local counts = { arithmetic = 2000, units = 1000, currency = 500, symbolic = 50, matrix = 500 }
+
+local results = {}
+
+local function percentile(sorted, p)
+    return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+-- runs fn(i) n times after warmup untimed runs and records the latency distribution
+local function measure(group, name, n, fn, warmup)
+    for i = 1, warmup or 0 do
+        fn(i)
+    end
+
+    local samples = {}
+    local start = now_ms()
+    for i = 1, n do
+        local t = now_ms()
+        fn(i)
+        samples[i] = now_ms() - t
+    end
+    local total = now_ms() - start
+
+    table.sort(samples)
+    local rss, peak = memory()
+    local res = {
+        group = group,
+        name = name,
+        n = n,
+        p50_ms = percentile(samples, 0.5),
+        p95_ms = percentile(samples, 0.95),
+        p99_ms = percentile(samples, 0.99),
+        max_ms = samples[#samples],
+        ops_per_s = n / (total / 1e3),
+        rss_kb = rss,
+        peak_rss_kb = peak,
+    }
+    results[#results + 1] = res
+    print(("%-10s %-24s %7d %10.4f %10.4f %10.4f %12.1f %10d"):format(
+        group,
+        name,
+        n,
+        res.p50_ms,
+        res.p95_ms,
+        res.p99_ms,
+        res.ops_per_s,
+        peak
+    ))
+    return res
+end
+
+print(("%-10s %-24s %7s %10s %10s %10s %12s %10s"):format(
+    "group",
+    "name",
+    "n",
+    "p50 ms",
+    "p95 ms",
+    "p99 ms",
+    "ops/s",
+    "peak kB"
+))
+
+-- new
+measure("new", "eager", iterations(5), function()
+    qalc.new()
+end)
+measure("new", "eager, no rates", iterations(5), function()
+    qalc.new(nil, { exchange_rates = false })
+end)
+measure("new", "lazy", iterations(200), function()
+    qalc.new(nil, { definitions = "lazy" })
+end)
+measure("new", "shared", iterations(200), function()
+    qalc.new(nil, { shared = true }):eval("1")
+end)
+collectgarbage()
+
+local calc = qalc.new()
+
+-- eval, without the result cache so every call calculates
+calc:set_cache_size(0)
+local exprs = {}
+for _, category in ipairs(categories) do
+    local list = corpus[category]
+    measure("eval", category, iterations(counts[category]), function(i)
+        calc:eval(list[(i - 1) % #list + 1])
+    end, #list)
+    exprs[category] = calc:eval(list[#list])
+end
+
+calc:set_cache_size(256)
+measure("eval", "symbolic, cached", iterations(counts.symbolic * 20), function(i)
+    local list = corpus.symbolic
+    calc:eval(list[(i - 1) % #list + 1])
+end, #corpus.symbolic)
+
+local parse_opts = qalc.parse_options({ source = "none" })
+measure("eval", "arithmetic, no source", iterations(counts.arithmetic), function(i)
+    local list = corpus.arithmetic
+    calc:eval(list[(i - 1) % #list + 1], parse_opts)
+end, #corpus.arithmetic)
+calc:set_cache_size(0)
+
+-- a document's worth of symbolic blocks, eval by eval and with one eval_batch
+local batch = {}
+for i = 1, 32 do
+    batch[i] = corpus.symbolic[(i - 1) % #corpus.symbolic + 1]
+end
+measure("eval", "32 symbolic, serial", iterations(5), function()
+    for _, expr in ipairs(batch) do
+        calc:eval(expr)
+    end
+end)
+measure("eval", "32 symbolic, eval_batch", iterations(5), function()
+    calc:eval_batch(batch)
+end)
+
+-- print and value of one result per category
+local print_opts = { unicode = "on", interval_display = "concise" }
+for _, category in ipairs(categories) do
+    local expr = exprs[category]
+    measure("print", category, iterations(1000), function()
+        expr:print(print_opts)
+    end, 10)
+    measure("value", category, iterations(1000), function()
+        expr:value()
+    end, 10)
+end
+
+-- plot at several step sizes
+local plotted = 0
+local plotter = qalc.new(function(x)
+    plotted = plotted + #x
+end)
+plotter:set_cache_size(0)
+for _, step in ipairs({ "0.1", "0.01", "0.001", "0.0001" }) do
+    local n = iterations(step == "0.0001" and 10 or 50)
+    measure("plot", "step " .. step, n, function()
+        plotter:eval(("plot(sin(x) * x^2, 0, 10, %s)"):format(step))
+    end, 1)
+    measure("plot", "step " .. step .. ", buffer", n, function()
+        plotter:eval(("plot(sin(x) * x^2, 0, 10, %s, \"out=buffer\")"):format(step))
+    end, 1)
+end
+measure("plot", "adaptive", iterations(50), function()
+    plotter:eval("plot(sin(1/x), 0.01, 1, 0.001, \"sampling=adaptive\")")
+end, 1)
+measure("plot", "3 series, step 0.001", iterations(50), function()
+    plotter:eval("plot([sin(x) * x^2, cos(x) * x^2, sin(x) * x^2 + cos(x)], 0, 10, 0.001)")
+end, 1)
+measure("plot", "symbolic, step 0.1", iterations(20), function()
+    plotter:eval("plot(gamma(x), 1, 10, 0.1)")
+end, 1)
+
+-- creating and dropping calculators must not grow memory
+calc, plotter, exprs = nil, nil, nil
+collectgarbage()
+collectgarbage()
+local rss_before = memory()
+measure("lifecycle", "new + eval + collect", iterations(20), function()
+    local c = qalc.new(nil, { exchange_rates = false })
+    c:eval("integrate(x^2, x)")
+    c = nil
+    collectgarbage()
+    collectgarbage()
+end)
+local rss_after = memory()
+results[#results].rss_growth_kb = rss_after - rss_before
+print(("lifecycle rss growth: %d kB"):format(rss_after - rss_before))
+
+local function json(value)
+    if type(value) == "string" then
+        return ('"%s"'):format(value:gsub('[%c"\\]', function(c)
+            return ("\\u%04x"):format(c:byte())
+        end))
+    elseif type(value) == "number" then
+        return value == value and tostring(value) or "null"
+    end
+
+    local fields = {}
+    for k, v in pairs(value) do
+        fields[#fields + 1] = json(k) .. ":" .. json(v)
+    end
+    table.sort(fields)
+    return "{" .. table.concat(fields, ",") .. "}"
+end
+
+local f = assert(io.open(output, "w"))
+for _, res in ipairs(results) do
+    f:write(json(res), "\n")
+end
+f:close()
+print("wrote " .. output)
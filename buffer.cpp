@@ -0,0 +1,74 @@
+#include "buffer.hpp"
+
+#include <algorithm>
+
+LBuffer* new_Buffer(lua_State* L, size_t len) {
+    LBuffer* buf = (LBuffer*)lua_newuserdata(L, sizeof(LBuffer) + len * sizeof(double));
+    luaL_getmetatable(L, "QalcBuffer");
+    lua_setmetatable(L, -2);
+
+    buf->len = len;
+    return buf;
+}
+
+void push_Buffer(lua_State* L, const double* data, size_t len) {
+    LBuffer* buf = new_Buffer(L, len);
+    std::copy(data, data + len, buf->data());
+}
+
+LBuffer* check_Buffer(lua_State* L, int index) { return (LBuffer*)luaL_checkudata(L, index, "QalcBuffer"); }
+
+static int l_buffer_len(lua_State* L) {
+    LBuffer* self = check_Buffer(L, 1);
+    lua_pushinteger(L, self->len);
+    return 1;
+}
+
+static int l_buffer_index(lua_State* L) {
+    LBuffer* self = check_Buffer(L, 1);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = lua_tointeger(L, 2);
+        if (i >= 1 && (size_t)i <= self->len) {
+            lua_pushnumber(L, self->data()[i - 1]);
+        } else {
+            lua_pushnil(L);
+        }
+        return 1;
+    }
+
+    // methods
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int l_buffer_ptr(lua_State* L) {
+    LBuffer* self = check_Buffer(L, 1);
+    lua_pushlightuserdata(L, self->data());
+    return 1;
+}
+
+static int l_buffer_totable(lua_State* L) {
+    LBuffer* self = check_Buffer(L, 1);
+    lua_createtable(L, self->len, 0);
+    for (size_t i = 0; i < self->len; i++) {
+        lua_pushnumber(L, self->data()[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+void register_Buffer(lua_State* L) {
+    luaL_newmetatable(L, "QalcBuffer");
+
+    const luaL_Reg buffer_mt[] = {
+        {"__len", l_buffer_len},
+        {"__index", l_buffer_index},
+        {"ptr", l_buffer_ptr},
+        {"totable", l_buffer_totable},
+        {NULL},
+    };
+    luaL_register(L, NULL, buffer_mt);
+    lua_pop(L, 1);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <lua5.1/lua.hpp>
+#include <stddef.h>
+
+// QalcBuffer, a userdata holding a length followed by that many doubles
+struct LBuffer {
+    size_t len;
+
+    double* data() { return (double*)(this + 1); }
+};
+
+// pushes a new buffer of len uninitialized values
+LBuffer* new_Buffer(lua_State* L, size_t len);
+void push_Buffer(lua_State* L, const double* data, size_t len);
+LBuffer* check_Buffer(lua_State* L, int index);
+
+// creates the QalcBuffer metatable
+void register_Buffer(lua_State* L);
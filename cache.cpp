@@ -0,0 +1,77 @@
+#include "cache.hpp"
+
+#include <libqalculate/ExpressionItem.h>
+#include <libqalculate/Function.h>
+
+ResultCache::ResultCache(size_t capacity) : max_entries(capacity) {}
+
+CachedResult const* ResultCache::find(std::string const& key, unsigned long epoch) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        misses++;
+        return NULL;
+    }
+
+    if (it->second->epoch != epoch) {
+        entries.erase(it->second);
+        index.erase(it);
+        misses++;
+        return NULL;
+    }
+
+    entries.splice(entries.begin(), entries, it->second);
+    hits++;
+    return &entries.front().result;
+}
+
+void ResultCache::insert(std::string const& key, unsigned long epoch, CachedResult result) {
+    if (max_entries == 0) {
+        return;
+    }
+
+    auto it = index.find(key);
+    if (it != index.end()) {
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    entries.push_front({key, epoch, std::move(result)});
+    index[key] = entries.begin();
+    resize(max_entries);
+}
+
+void ResultCache::resize(size_t capacity) {
+    max_entries = capacity;
+    while (entries.size() > max_entries) {
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+void ResultCache::clear() {
+    entries.clear();
+    index.clear();
+}
+
+static const char* const impure_functions[] = {
+    "plot", "rand", "randn", "randpoisson", "now", "today", "timestamp", "command", "load", NULL,
+};
+
+bool is_cacheable(MathStructure const& parsed) {
+    if (parsed.isFunction()) {
+        std::string const& name = parsed.function()->referenceName();
+        for (int i = 0; impure_functions[i]; i++) {
+            if (name == impure_functions[i]) {
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < parsed.size(); i++) {
+        if (!is_cacheable(parsed[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <libqalculate/MathStructure.h>
+#include <libqalculate/includes.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "util.hpp"
+
+struct CachedResult {
+    MathStructure expr;
+    MathStructure parsed_src;
+    MessageList messages;
+};
+
+// Bounded LRU map from expression + options to calculation results.
+// Entries remember the variable epoch they were computed in and are
+// only returned while the calculator is still in that epoch.
+class ResultCache {
+  public:
+    ResultCache(size_t capacity);
+
+    // nullable, the pointer stays valid until the next insert/resize/clear
+    CachedResult const* find(std::string const& key, unsigned long epoch);
+    void insert(std::string const& key, unsigned long epoch, CachedResult result);
+
+    void resize(size_t capacity);
+    void clear();
+
+    size_t size() const { return entries.size(); }
+    size_t capacity() const { return max_entries; }
+
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+  private:
+    struct Entry {
+        std::string key;
+        unsigned long epoch;
+        CachedResult result;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t max_entries;
+};
+
+// false if evaluating the parsed expression has side effects or
+// may give a different result every time
+bool is_cacheable(MathStructure const& parsed);
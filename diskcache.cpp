@@ -0,0 +1,292 @@
+#include "diskcache.hpp"
+#include "cache.hpp"
+#include "serialize.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <libqalculate/ExpressionItem.h>
+#include <libqalculate/Function.h>
+#include <libqalculate/Unit.h>
+#include <libqalculate/Variable.h>
+#include <libqalculate/includes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// first bytes of every file, bumped when the format of serialize.hpp changes
+#define DISK_CACHE_MAGIC "QDC2"
+// user defined variables referencing each other deeper than this are not cached
+#define DISK_CACHE_MAX_DEPTH 8
+
+DiskCache::DiskCache(std::string dir, size_t max_bytes, int min_ms)
+    : dir(std::move(dir)), max_bytes(max_bytes), min_time(min_ms) {}
+
+static bool make_dirs(std::string const& dir) {
+    for (size_t slash = dir.find('/', 1); slash != std::string::npos; slash = dir.find('/', slash + 1)) {
+        if (mkdir(dir.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static std::string file_name(std::string const& key) {
+    char name[17];
+    snprintf(name, sizeof(name), "%016zx", std::hash<std::string>{}(key));
+    return name;
+}
+
+static bool is_entry_name(const char* name) {
+    size_t len = strlen(name);
+    return len == 16 && strspn(name, "0123456789abcdef") == len;
+}
+
+bool DiskCache::open() {
+    if (!make_dirs(dir)) {
+        return false;
+    }
+
+    DIR* listing = opendir(dir.c_str());
+    if (!listing) {
+        return false;
+    }
+
+    entries.clear();
+    total_bytes = 0;
+    while (dirent* file = readdir(listing)) {
+        struct stat st;
+        if (is_entry_name(file->d_name) && stat(path(file->d_name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            entries[file->d_name] = {(size_t)st.st_size, st.st_mtime};
+            total_bytes += st.st_size;
+        }
+    }
+    closedir(listing);
+
+    evict();
+    return true;
+}
+
+static bool read_file(std::string const& path, std::string& data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    char buf[65536];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        data.append(buf, n);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool DiskCache::find(std::string const& key, Calculator* calc, MathStructure& expr, MessageList& messages) {
+    std::string name = file_name(key);
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        misses++;
+        return false;
+    }
+
+    std::string data;
+    if (!read_file(path(name), data)) {
+        // removed by another process
+        total_bytes -= it->second.bytes;
+        entries.erase(it);
+        misses++;
+        return false;
+    }
+
+    std::string_view in = data;
+    unsigned long key_size;
+    bool ok = in.substr(0, strlen(DISK_CACHE_MAGIC)) == DISK_CACHE_MAGIC;
+    if (ok) {
+        in.remove_prefix(strlen(DISK_CACHE_MAGIC));
+        ok = read_varint(in, key_size) && key_size <= in.size();
+    }
+    if (ok && in.substr(0, key_size) != key) {
+        // a hash collision, the file holds whichever of the keys was stored last
+        misses++;
+        return false;
+    }
+    if (ok) {
+        in.remove_prefix(key_size);
+        ok = read_MathStructure(in, calc, expr) && read_MessageList(in, messages);
+    }
+    if (!ok) {
+        // written by another version, or names that are no longer defined
+        remove(name);
+        misses++;
+        return false;
+    }
+
+    // the modification time orders the files for eviction
+    utimensat(AT_FDCWD, path(name).c_str(), NULL, 0);
+    it->second.used = time(NULL);
+    hits++;
+    return true;
+}
+
+static bool uses_currency(MathStructure const& expr) {
+    if (expr.isUnit() && expr.unit()->isCurrency()) {
+        return true;
+    }
+    for (size_t i = 0; i < expr.size(); i++) {
+        if (uses_currency(expr[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DiskCache::insert(std::string const& key, MathStructure const& expr, MessageList const& messages) {
+    // exchange rates change from one session to the next
+    if (uses_currency(expr)) {
+        return;
+    }
+
+    std::string data = DISK_CACHE_MAGIC;
+    write_varint(data, key.size());
+    data += key;
+    if (!write_MathStructure(data, expr)) {
+        return;
+    }
+    write_MessageList(data, messages);
+    if (data.size() > max_bytes) {
+        return;
+    }
+
+    // written in full under a temporary name, so readers never see half a file
+    std::string name = file_name(key);
+    std::string tmp = path(name) + ".tmp" + std::to_string(getpid());
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path(name).c_str()) != 0) {
+        unlink(tmp.c_str());
+        return;
+    }
+
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        total_bytes -= it->second.bytes;
+    }
+    entries[name] = {data.size(), time(NULL)};
+    total_bytes += data.size();
+    evict();
+}
+
+void DiskCache::remove(std::string const& name) {
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        return;
+    }
+    unlink(path(name).c_str());
+    total_bytes -= it->second.bytes;
+    entries.erase(it);
+}
+
+void DiskCache::evict() {
+    if (total_bytes <= max_bytes) {
+        return;
+    }
+
+    std::vector<std::pair<std::time_t, std::string>> by_age;
+    for (auto const& [name, entry] : entries) {
+        by_age.push_back({entry.used, name});
+    }
+    std::sort(by_age.begin(), by_age.end());
+
+    for (size_t i = 0; i < by_age.size() && total_bytes > max_bytes; i++) {
+        remove(by_age[i].second);
+    }
+}
+
+void DiskCache::clear() {
+    while (!entries.empty()) {
+        remove(entries.begin()->first);
+    }
+}
+
+std::string default_disk_cache_dir() {
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home && *cache_home) {
+        return std::string(cache_home) + "/qalculate.nvim";
+    }
+    const char* home = getenv("HOME");
+    return std::string(home ? home : "/tmp") + "/.cache/qalculate.nvim";
+}
+
+// Appends the definitions of the user defined variables in expr. Builtin ones only change
+// with the options, which are part of the key already. Returns false for user defined functions
+// and unknowns: a function's formula names further definitions and an unknown's assumptions are
+// not in the key.
+static bool append_definitions(std::string& key, MathStructure const& expr, int depth) {
+    if (depth > DISK_CACHE_MAX_DEPTH) {
+        return false;
+    }
+
+    if (expr.isVariable() && expr.variable()->isLocal()) {
+        if (!expr.variable()->isKnown()) {
+            return false;
+        }
+        KnownVariable* var = (KnownVariable*)expr.variable();
+        key += var->referenceName();
+        key.push_back('\0');
+        if (!write_MathStructure(key, var->get()) || !append_definitions(key, var->get(), depth + 1)) {
+            return false;
+        }
+    } else if (expr.isFunction() && expr.function()->isLocal()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < expr.size(); i++) {
+        if (!append_definitions(key, expr[i], depth)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_for_disk_cache(Calculator* calc, std::string const& expr, EvaluationOptions const& eo,
+                          std::string const& options, MathStructure& parsed, std::string& to, std::string& key) {
+    key.clear();
+    // calculate() applies the to part to the result, it stays text in the key
+    std::string from = expr, where;
+    calc->separateToExpression(from, to, eo, true);
+    calc->separateWhereExpression(from, where, eo);
+    if (!where.empty()) {
+        return false;
+    }
+
+    parsed = calc->parse(from, eo.parse_options);
+    if (!is_cacheable(parsed) || uses_currency(parsed)) {
+        return true;
+    }
+
+    // results and definitions may differ between versions of libqalculate
+    key = std::to_string(QALCULATE_MAJOR_VERSION) + "." + std::to_string(QALCULATE_MINOR_VERSION) + "." +
+          std::to_string(QALCULATE_MICRO_VERSION);
+    key.push_back('\0');
+    key += options;
+    key.push_back('\0');
+    key += to;
+    key.push_back('\0');
+    if (!write_MathStructure(key, parsed) || !append_definitions(key, parsed, 0)) {
+        key.clear();
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <ctime>
+#include <libqalculate/Calculator.h>
+#include <libqalculate/MathStructure.h>
+#include <libqalculate/includes.h>
+#include <string>
+#include <unordered_map>
+
+#include "util.hpp"
+
+// Results that took long to calculate, kept across sessions in one file per entry.
+// Files are named after the hash of their key and also hold the key, to tell
+// collisions apart. Once the files add up to more than max_bytes, the least
+// recently used ones are removed. Several processes may share a directory.
+class DiskCache {
+  public:
+    // results that took less than min_ms are not stored
+    DiskCache(std::string dir, size_t max_bytes, int min_ms);
+
+    // creates the directory and indexes the files in it, false if that fails
+    bool open();
+
+    // Only reads a file if the key is in the index, so a miss costs no system call.
+    // Results are read back with the names known to calc, see serialize.hpp.
+    bool find(std::string const& key, Calculator* calc, MathStructure& expr, MessageList& messages);
+    void insert(std::string const& key, MathStructure const& expr, MessageList const& messages);
+
+    // removes every entry, also from the disk
+    void clear();
+
+    int min_ms() const { return min_time; }
+    size_t bytes() const { return total_bytes; }
+    size_t size() const { return entries.size(); }
+
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+  private:
+    struct Entry {
+        size_t bytes;
+        std::time_t used;
+    };
+
+    std::string path(std::string const& name) const { return dir + "/" + name; }
+    void remove(std::string const& name);
+    void evict();
+
+    std::string dir;
+    size_t max_bytes;
+    int min_time;
+    size_t total_bytes = 0;
+    std::unordered_map<std::string, Entry> entries; // by file name
+};
+
+// $XDG_CACHE_HOME/qalculate.nvim, or ~/.cache/qalculate.nvim without it
+std::string default_disk_cache_dir();
+
+// Parses expr once for both DiskCache and calc->calculate(parsed, eo, to), to calculate it on a miss.
+// Returns false if it has a where part, which only calculating the text handles.
+// key is set to identify the result by its parsed form, the options (see options_key) and the
+// values of the user defined variables it uses, or to "" if the result should not be stored,
+// like for eval's ResultCache. Messages of parsing are left to the calculation.
+// Call with the calculator locked.
+bool parse_for_disk_cache(Calculator* calc, std::string const& expr, EvaluationOptions const& eo,
+                          std::string const& options, MathStructure& parsed, std::string& to, std::string& key);
@@ -1,4 +1,6 @@
 #include "function.hpp"
+#include "buffer.hpp"
+#include "program.hpp"
 #include "util.hpp"
 
 #include <libqalculate/Calculator.h>
@@ -8,18 +10,30 @@
 #include <libqalculate/Number.h>
 #include <libqalculate/includes.h>
 #include <libqalculate/util.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
 #include <limits>
 #include <lua.h>
 #include <lua5.1/lua.hpp>
+#include <numeric>
 #include <optional>
+#include <queue>
 #include <string_view>
+#include <thread>
 
 using std::string;
 
-extern int QALC_CURRENT_PLOT_HANDLER;
-extern lua_State* QALC_CURRENT_LUA_STATE;
+// refuse to sample more points than this
+#define PLOT_MAX_POINTS (1 << 24)
+// fewer points per thread are not worth starting a thread for
+#define PLOT_POINTS_PER_THREAD 32768
+// default points= budget of sampling=adaptive
+#define PLOT_ADAPTIVE_POINTS 1024
+// acceptable deviation from a straight line, relative to the y range
+#define PLOT_ADAPTIVE_TOLERANCE 1e-3
 
-ReturnPlotFunction::ReturnPlotFunction() : MathFunction("plot", 4, -1) {
+ReturnPlotFunction::ReturnPlotFunction(PlotTarget* target) : MathFunction("plot", 4, -1), target(target) {
     NumberArgument* start = new NumberArgument();
     start->setComplexAllowed(false);
     start->setHandleVector(false);
@@ -47,6 +61,13 @@ ReturnPlotFunction::ReturnPlotFunction(const ReturnPlotFunction* function) { set
 
 ExpressionItem* ReturnPlotFunction::copy() const { return new ReturnPlotFunction(this); }
 
+void ReturnPlotFunction::set(const ExpressionItem* item) {
+    MathFunction::set(item);
+    if (const ReturnPlotFunction* function = dynamic_cast<const ReturnPlotFunction*>(item)) {
+        target = function->target;
+    }
+}
+
 std::string_view trim(std::string_view sv) {
     while (!sv.empty() && std::isspace(static_cast<unsigned char>(sv.front())))
         sv.remove_prefix(1);
@@ -64,117 +85,494 @@ std::pair<std::string_view, std::string_view> split_var(std::string_view str) {
     return {trim(str.substr(0, eq)), trim(str.substr(eq + 1))};
 }
 
+// number of points in start, start + step, ... <= max
+static size_t count_points(Number const& start, Number const& max, Number const& step) {
+    Number count = max;
+    count.subtract(start);
+    count.divide(step);
+    count.floor();
+
+    bool overflow = false;
+    long n = count.lintValue(&overflow);
+    if (overflow || n >= PLOT_MAX_POINTS) {
+        return PLOT_MAX_POINTS + 1;
+    }
+    return n < 0 ? 0 : n + 1;
+}
+
+static Number nth_point(Number const& start, Number const& step, size_t i) {
+    Number x = step;
+    x.multiply(Number((long)i));
+    x.add(start);
+    return x;
+}
+
+// points first to first + count - 1 of the grid
+static std::vector<double> uniform_grid(Number const& start, Number const& step, size_t count, size_t first = 0) {
+    double x0 = start.floatValue(), dx = step.floatValue();
+    std::vector<double> x_values(count);
+    for (size_t i = 0; i < count; i++) {
+        x_values[i] = x0 + (first + i) * dx;
+    }
+    return x_values;
+}
+
+static double sample_exact(MathStructure const& expr, MathStructure const& xvar, Number const& x) {
+    MathStructure y = expr;
+    y.replace(xvar, x);
+    y.eval();
+
+    if (y.isUndefined() || y.isInfinite() || !y.isNumber()) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return y.number().floatValue();
+}
+
+// exact sampling reports poles as undefined, the double precision program as infinite
+static double pole_to_nan(double y) {
+    return std::isinf(y) ? std::numeric_limits<double>::quiet_NaN() : y;
+}
+
+// spot checks every output of the double precision program at both ends and the middle of the first count grid points
+static bool agrees_with_exact(Program const& program, std::vector<const MathStructure*> const& exprs,
+                              MathStructure const& xvar, Number const& start, Number const& step, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+
+    std::vector<double> fast(exprs.size());
+    for (size_t i : {(size_t)0, count / 2, count - 1}) {
+        double x = uniform_grid(start, step, 1, i)[0];
+        program.run(&x, fast.data());
+
+        for (size_t k = 0; k < exprs.size(); k++) {
+            double y = pole_to_nan(fast[k]);
+            double exact = sample_exact(*exprs[k], xvar, nth_point(start, step, i));
+
+            if (std::isnan(y) != std::isnan(exact) ||
+                (!std::isnan(exact) && std::fabs(y - exact) > 1e-9 * std::fmax(1, std::fabs(exact)))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// the y arrays of data, one per expression
+static std::vector<std::vector<double>*> y_arrays(PlotData& data) {
+    std::vector<std::vector<double>*> arrays = {&data.y_values};
+    for (std::vector<double>& y : data.extra_y) {
+        arrays.push_back(&y);
+    }
+    return arrays;
+}
+
+// splits the points into one contiguous chunk per thread, the caller's thread takes the first
+static void run_parallel(Program const& program, std::vector<double> const& x_values,
+                         std::vector<std::vector<double>*> const& y_arrays, unsigned threads) {
+    size_t count = x_values.size();
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    threads = std::max(1u, std::min<unsigned>(threads, count / PLOT_POINTS_PER_THREAD));
+
+    size_t chunk = (count + threads - 1) / threads;
+    auto run_chunk = [&](size_t begin) {
+        size_t len = std::min(chunk, count - begin);
+        const double* args[] = {x_values.data() + begin};
+        std::vector<double*> out;
+        for (std::vector<double>* y : y_arrays) {
+            out.push_back(y->data() + begin);
+        }
+        program.run_batch(args, out.data(), len);
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++) {
+        workers.emplace_back(run_chunk, t * chunk);
+    }
+    run_chunk(0);
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    for (std::vector<double>* y_values : y_arrays) {
+        for (double& y : *y_values) {
+            y = pole_to_nan(y);
+        }
+    }
+}
+
+struct Segment {
+    double x0, y0, x1, y1;
+    double xm, ym; // already sampled midpoint
+    double error;
+
+    bool operator<(Segment const& other) const { return error < other.error; }
+};
+
+// Starts from the points in grid and keeps splitting the segment whose midpoint is furthest off
+// the straight line between its ends, until the curve is smooth enough or max_points are used up.
+// Points that lie on a line with their neighbours are dropped afterwards.
+static void sample_adaptive(std::function<double(double)> const& f, std::vector<double> const& grid,
+                            size_t max_points, PlotData& data) {
+    data.x_values = grid;
+    data.y_values.resize(grid.size());
+    for (size_t i = 0; i < grid.size(); i++) {
+        data.y_values[i] = f(grid[i]);
+    }
+
+    double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+    for (double y : data.y_values) {
+        if (!std::isnan(y)) {
+            lo = std::min(lo, y);
+            hi = std::max(hi, y);
+        }
+    }
+    double tolerance = (hi > lo ? hi - lo : 1) * PLOT_ADAPTIVE_TOLERANCE;
+    double min_width = (grid.back() - grid.front()) * 1e-9;
+
+    auto split = [&](double x0, double y0, double x1, double y1) {
+        double xm = (x0 + x1) / 2, ym = f(xm);
+        data.x_values.push_back(xm);
+        data.y_values.push_back(ym);
+
+        double error;
+        if (x1 - x0 < min_width) {
+            error = 0;
+        } else if (std::isnan(y0) || std::isnan(y1) || std::isnan(ym)) {
+            // refine towards the edge of where the function is defined
+            error = std::isnan(y0) && std::isnan(y1) && std::isnan(ym) ? 0 : hi - lo + tolerance;
+        } else {
+            error = std::fabs(ym - (y0 + y1) / 2);
+        }
+        return Segment{x0, y0, x1, y1, xm, ym, error};
+    };
+
+    std::priority_queue<Segment> queue;
+    for (size_t i = 0; i + 1 < grid.size() && data.x_values.size() < max_points; i++) {
+        queue.push(split(grid[i], data.y_values[i], grid[i + 1], data.y_values[i + 1]));
+    }
+
+    while (!queue.empty() && data.x_values.size() + 2 <= max_points && !CALCULATOR->aborted()) {
+        Segment seg = queue.top();
+        if (seg.error <= tolerance) {
+            break;
+        }
+        queue.pop();
+
+        queue.push(split(seg.x0, seg.y0, seg.xm, seg.ym));
+        queue.push(split(seg.xm, seg.ym, seg.x1, seg.y1));
+    }
+
+    std::vector<size_t> order(data.x_values.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return data.x_values[a] < data.x_values[b]; });
+
+    std::vector<double> x_values, y_values;
+    for (size_t k = 0; k < order.size(); k++) {
+        double x = data.x_values[order[k]], y = data.y_values[order[k]];
+        if (!x_values.empty() && k + 1 < order.size()) {
+            double xa = x_values.back(), ya = y_values.back();
+            double xb = data.x_values[order[k + 1]], yb = data.y_values[order[k + 1]];
+            if (!std::isnan(ya) && !std::isnan(y) && !std::isnan(yb) &&
+                std::fabs(y - (ya + (yb - ya) * (x - xa) / (xb - xa))) <= tolerance / 4) {
+                continue;
+            }
+        }
+        x_values.push_back(x);
+        y_values.push_back(y);
+    }
+
+    data.x_values = std::move(x_values);
+    data.y_values = std::move(y_values);
+}
+
+static std::optional<double> parse_number(std::string_view value, const EvaluationOptions& eo) {
+    MathStructure num = CALCULATOR->parse(string(value));
+    num.eval(eo);
+    if (!num.isNumber()) {
+        return std::nullopt;
+    }
+    return num.number().floatValue();
+}
+
+bool call_PlotHandler(lua_State* L, int handler, PlotData const& data, Stats* stats, bool raise) {
+    StatTimer timer(stats, STAT_PLOT_CALLBACK);
+    if (stats) {
+        stats->add_objects(0, 3);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handler);
+    if (data.done) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    } else {
+        auto push_values = [&](std::vector<double> const& values) {
+            if (data.buffers) {
+                push_Buffer(L, values.data(), values.size());
+                return;
+            }
+            lua_createtable(L, values.size(), 0);
+            for (size_t i = 0; i < values.size(); i++) {
+                lua_pushnumber(L, values[i]);
+                lua_rawseti(L, -2, i + 1);
+            }
+        };
+
+        push_values(data.x_values);
+        if (data.series) {
+            lua_createtable(L, data.extra_y.size() + 1, 0);
+            push_values(data.y_values);
+            lua_rawseti(L, -2, 1);
+            for (size_t k = 0; k < data.extra_y.size(); k++) {
+                push_values(data.extra_y[k]);
+                lua_rawseti(L, -2, k + 2);
+            }
+        } else {
+            push_values(data.y_values);
+        }
+    }
+
+    lua_newtable(L);
+    if (data.step_size.has_value()) {
+        lua_pushnumber(L, data.step_size.value());
+        lua_setfield(L, -2, "step");
+    }
+    if (data.xfmt.has_value()) {
+        push_cppstr(L, data.xfmt.value());
+        lua_setfield(L, -2, "xfmt");
+    }
+    if (data.line_type.has_value()) {
+        push_cppstr(L, data.line_type.value());
+        lua_setfield(L, -2, "type");
+    }
+    if (data.y_range.has_value()) {
+        lua_newtable(L);
+        lua_pushnumber(L, data.y_range.value().first);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, data.y_range.value().second);
+        lua_rawseti(L, -2, 2);
+        lua_setfield(L, -2, "range");
+    }
+    lua_newtable(L);
+    for (size_t i = 0; i < data.extra_directives.size(); i++) {
+        push_cppstr(L, data.extra_directives[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "extra");
+    if (data.series) {
+        lua_pushinteger(L, data.extra_y.size() + 1);
+        lua_setfield(L, -2, "series");
+    }
+    if (data.chunk > 0) {
+        lua_pushinteger(L, data.chunk);
+        lua_setfield(L, -2, "chunk");
+    }
+    if (data.done) {
+        lua_pushboolean(L, true);
+        lua_setfield(L, -2, "done");
+    }
+
+    if (raise) {
+        lua_call(L, 3, 1);
+    } else if (lua_pcall(L, 3, 1, 0) != 0) {
+        const char* msg = lua_tostring(L, -1);
+        CALCULATOR->error(true, "plot handler failed: %s", msg ? msg : "(error object is not a string)", NULL);
+        lua_pop(L, 1);
+        return false;
+    }
+    bool keep_going = !lua_isboolean(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return keep_going;
+}
+
 int ReturnPlotFunction::calculate(MathStructure& mstruct, const MathStructure& vargs, const EvaluationOptions& eo) {
-    if (!QALC_CURRENT_PLOT_HANDLER) {
+    if (!target->handler && !target->deferred) {
         return 0;
     }
 
-    std::optional<double> step_size;
-    std::optional<string> xfmt;
-    std::optional<string> line_type;
-    std::optional<std::pair<double, double>> y_range;
-    std::vector<string> extra_directives;
+    PlotData data;
+    unsigned threads = 0;
+    bool adaptive = false;
+    size_t max_points = PLOT_ADAPTIVE_POINTS;
+    size_t chunk_size = 0;
 
     for (size_t i = 4; i < vargs.size(); i++) {
         string meta = vargs[i].symbol();
         auto [name, value] = split_var(meta);
         bool has_value = value.size() > 0;
         if (name == "step" && has_value) {
-            MathStructure display_step = CALCULATOR->parse(string(value));
-            display_step.eval(eo);
-            if (display_step.isNumber()) {
-                step_size = display_step.number().floatValue();
-            } else {
+            data.step_size = parse_number(value, eo);
+            if (!data.step_size.has_value()) {
                 CALCULATOR->error(false, "step= value must be a number");
             }
+        } else if (name == "threads" && has_value) {
+            auto n = parse_number(value, eo);
+            if (n.has_value() && n.value() >= 0) {
+                // more threads than this only add overhead, and a larger double would not fit
+                unsigned max_threads = 4 * std::max(1u, std::thread::hardware_concurrency());
+                threads = std::min<double>(n.value(), max_threads);
+            } else {
+                CALCULATOR->error(false, "threads= value must be a number >= 0");
+            }
+        } else if (name == "sampling" && has_value) {
+            if (value == "adaptive" || value == "fixed") {
+                adaptive = value == "adaptive";
+            } else {
+                CALCULATOR->error(false, "sampling= value must be adaptive or fixed");
+            }
+        } else if (name == "points" && has_value) {
+            auto n = parse_number(value, eo);
+            if (n.has_value() && n.value() >= 2 && n.value() <= PLOT_MAX_POINTS) {
+                max_points = n.value();
+            } else {
+                CALCULATOR->error(false, "points= value must be a number >= 2");
+            }
+        } else if (name == "chunk" && has_value) {
+            auto n = parse_number(value, eo);
+            if (n.has_value() && n.value() >= 1) {
+                // larger chunks are the same as no chunking, as plots have at most that many points
+                chunk_size = std::min<double>(n.value(), PLOT_MAX_POINTS);
+            } else {
+                CALCULATOR->error(false, "chunk= value must be a number >= 1");
+            }
+        } else if (name == "out" && has_value) {
+            if (value == "buffer" || value == "table") {
+                data.buffers = value == "buffer";
+            } else {
+                CALCULATOR->error(false, "out= value must be buffer or table");
+            }
         } else if (name == "fmt-x" && has_value) {
-            xfmt = value;
+            data.xfmt = value;
         } else if (name == "type" && has_value) {
-            line_type = value;
+            data.line_type = value;
         } else if (name == "range" && has_value) {
             MathStructure range = CALCULATOR->parse(string(value));
             range.eval(eo);
             if (!range.isVector() || range.countChildren() != 2 || !range[0].isNumber() || !range[1].isNumber()) {
                 CALCULATOR->error(false, "range should be a vector of two numbers");
             } else {
-                y_range = {
+                data.y_range = {
                     range[0].number().floatValue(),
                     range[1].number().floatValue(),
                 };
             }
         } else if (name == "add" && has_value) {
-            extra_directives.push_back(string(value));
+            data.extra_directives.push_back(string(value));
         }
     }
 
-    MathStructure expr = vargs[0], xvar = CALCULATOR->getVariableById(VARIABLE_ID_X);
-    MathStructure xvalue = vargs[1], max = vargs[2], step = vargs[3];
+    // a vector of expressions is plotted as one series per expression over the same points
+    std::vector<const MathStructure*> exprs;
+    if (vargs[0].isVector()) {
+        for (size_t i = 0; i < vargs[0].size(); i++) {
+            exprs.push_back(&vargs[0][i]);
+        }
+        data.series = true;
+        data.extra_y.resize(exprs.empty() ? 0 : exprs.size() - 1);
+    } else {
+        exprs.push_back(&vargs[0]);
+    }
+    if (exprs.empty()) {
+        CALCULATOR->error(true, "plot needs at least one expression");
+        return 0;
+    }
+    if (adaptive && exprs.size() > 1) {
+        CALCULATOR->error(false, "sampling=adaptive plots a single expression, using fixed sampling");
+        adaptive = false;
+    }
+
+    MathStructure const& expr = *exprs[0];
+    MathStructure xvar = CALCULATOR->getVariableById(VARIABLE_ID_X);
+    Number const &start = vargs[1].number(), &max = vargs[2].number(), &step = vargs[3].number();
 
     mstruct.clearVector();
-    MathStructure yvalue;
 
-    std::vector<double> x_values, y_values;
-    while (xvalue.number().isLessThanOrEqualTo(max.number())) {
-        yvalue = expr;
-        yvalue.replace(xvar, xvalue);
-        yvalue.eval();
+    size_t count = count_points(start, max, step);
+    if (count > PLOT_MAX_POINTS && !adaptive) {
+        CALCULATOR->error(true, "plot would need more than %s points", std::to_string(PLOT_MAX_POINTS).c_str(), NULL);
+        return 0;
+    }
+
+    Program program;
+    bool lowered = program.lower(exprs, {xvar}, default_evaluation_options);
 
-        x_values.push_back(xvalue.number().floatValue());
+    if (adaptive) {
+        size_t initial = std::clamp<size_t>(count, 2, std::max<size_t>(2, max_points / 4));
+        Number grid_step = max;
+        grid_step.subtract(start);
+        grid_step.divide(Number((long)initial - 1));
+        std::vector<double> grid = uniform_grid(start, grid_step, initial);
 
-        if (yvalue.isUndefined() || yvalue.isInfinite()) {
-            y_values.push_back(std::numeric_limits<double>::quiet_NaN());
-        } else if (yvalue.isNumber()) {
-            y_values.push_back(yvalue.number().floatValue());
+        if (lowered && agrees_with_exact(program, exprs, xvar, start, grid_step, grid.size())) {
+            sample_adaptive(
+                [&](double x) { return pole_to_nan(program.run(&x)); }, grid, max_points, data);
         } else {
-            y_values.push_back(std::numeric_limits<double>::quiet_NaN());
+            sample_adaptive([&](double x) { return sample_exact(expr, xvar, double_Number(x)); }, grid, max_points,
+                            data);
         }
+    } else {
+        bool fast = lowered && agrees_with_exact(program, exprs, xvar, start, step, count);
+        std::vector<std::vector<double>*> ys = y_arrays(data);
 
-        xvalue.calculateAdd(step, eo);
-    }
+        // points first to first + len - 1, returns false if the calculation was aborted
+        auto sample_fixed = [&](size_t first, size_t len) {
+            data.x_values = uniform_grid(start, step, len, first);
+            for (std::vector<double>* y : ys) {
+                y->resize(len);
+            }
+            if (fast) {
+                run_parallel(program, data.x_values, ys, threads);
+                return true;
+            }
 
-    lua_State* L = QALC_CURRENT_LUA_STATE;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, QALC_CURRENT_PLOT_HANDLER);
-    lua_newtable(L);
-    for (size_t i = 0; i < x_values.size(); i++) {
-        lua_pushnumber(L, x_values[i]);
-        lua_rawseti(L, -2, i + 1);
-    }
+            for (size_t i = 0; i < len; i++) {
+                if (CALCULATOR->aborted()) {
+                    data.x_values.resize(i);
+                    for (std::vector<double>* y : ys) {
+                        y->resize(i);
+                    }
+                    return false;
+                }
+                Number x = nth_point(start, step, first + i);
+                for (size_t k = 0; k < exprs.size(); k++) {
+                    (*ys[k])[i] = sample_exact(*exprs[k], xvar, x);
+                }
+            }
+            return true;
+        };
 
-    lua_newtable(L);
-    for (size_t i = 0; i < y_values.size(); i++) {
-        lua_pushnumber(L, y_values[i]);
-        lua_rawseti(L, -2, i + 1);
-    }
+        // streaming needs the handler while sampling, eval_async only calls it afterwards
+        if (chunk_size > 0 && !target->deferred) {
+            for (size_t first = 0; first < count; first += chunk_size) {
+                data.chunk++;
+                bool complete = sample_fixed(first, std::min(chunk_size, count - first));
+                if (!call_PlotHandler(target->L, target->handler, data, target->stats, false) ||
+                    !complete) {
+                    break;
+                }
+            }
 
-    lua_newtable(L);
-    if (step_size.has_value()) {
-        lua_pushnumber(L, step_size.value());
-        lua_setfield(L, -2, "step");
-    }
-    if (xfmt.has_value()) {
-        push_cppstr(L, xfmt.value());
-        lua_setfield(L, -2, "xfmt");
-    }
-    if (line_type.has_value()) {
-        push_cppstr(L, line_type.value());
-        lua_setfield(L, -2, "type");
-    }
-    if (y_range.has_value()) {
-        lua_newtable(L);
-        lua_pushnumber(L, y_range.value().first);
-        lua_rawseti(L, -2, 1);
-        lua_pushnumber(L, y_range.value().second);
-        lua_rawseti(L, -2, 2);
-        lua_setfield(L, -2, "range");
-    }
-    lua_newtable(L);
-    for (size_t i = 0; i < extra_directives.size(); i++) {
-        push_cppstr(L, extra_directives[i]);
-        lua_rawseti(L, -2, i + 1);
+            data.x_values = {};
+            for (std::vector<double>* y : ys) {
+                *y = {};
+            }
+            data.done = true;
+            call_PlotHandler(target->L, target->handler, data, target->stats, false);
+            mstruct.clear();
+            return 1;
+        }
+
+        sample_fixed(0, count);
     }
-    lua_setfield(L, -2, "extra");
 
-    lua_call(L, 3, 0);
+    if (target->deferred) {
+        target->deferred->push_back(std::move(data));
+    } else {
+        call_PlotHandler(target->L, target->handler, data, target->stats, false);
+    }
 
     mstruct.clear();
     return 1;
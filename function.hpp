@@ -1,15 +1,67 @@
+#pragma once
+
 #include <libqalculate/ExpressionItem.h>
 #include <libqalculate/Function.h>
 #include <libqalculate/includes.h>
+#include <lua5.1/lua.hpp>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+
+struct PlotData;
+
+// Where plot() sends its data. One per calculator, set for the duration of a
+// calculation by whoever holds the calculator's lock.
+struct PlotTarget {
+    lua_State* L = NULL;
+    int handler = 0;     // registry reference, plot() stays unevaluated without one
+    Stats* stats = NULL; // nullable
+    // set by threads that may not touch the lua state: plot() queues its data here
+    // and the owner of the lua state hands it to the handler later
+    std::vector<PlotData>* deferred = NULL;
+};
 
 class ReturnPlotFunction : public MathFunction {
   public:
-    ReturnPlotFunction();
+    ReturnPlotFunction(PlotTarget* target);
     ReturnPlotFunction(const ReturnPlotFunction* function);
     ExpressionItem* copy() const;
     int id() const;
+    void set(const ExpressionItem* item);
 
     int parse();
 
     int calculate(MathStructure& mstruct, const MathStructure& vargs, const EvaluationOptions& eo);
+
+  private:
+    PlotTarget* target;
 };
+
+struct PlotData {
+    std::vector<double> x_values, y_values;
+    // the y values of the second and later expressions when plotting a vector of them
+    std::vector<std::vector<double>> extra_y;
+    // plot() got a vector of expressions, y is passed as a list with one array per expression
+    bool series = false;
+
+    std::optional<double> step_size;
+    std::optional<std::string> xfmt;
+    std::optional<std::string> line_type;
+    std::optional<std::pair<double, double>> y_range;
+    std::vector<std::string> extra_directives;
+
+    // pass x and y as QalcBuffers instead of tables
+    bool buffers = false;
+
+    // when streaming with chunk=, the 1-based index of the chunk in x and y, 0 otherwise
+    size_t chunk = 0;
+    // the final call of a stream, x and y are nil
+    bool done = false;
+};
+
+// Calls the handler stored in the registry as handler(x, y, meta), recording into stats (nullable).
+// Returns false if the handler returned false. Inside libqalculate, where a Lua error must not
+// unwind, pass raise = false: an error is then reported through CALCULATOR->error and stops the plot.
+bool call_PlotHandler(lua_State* L, int handler, PlotData const& data, Stats* stats, bool raise);
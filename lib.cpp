@@ -1,33 +1,145 @@
+#include <cstddef>
 #include <cstdlib>
 #include <libqalculate/Calculator.h>
 #include <libqalculate/ExpressionItem.h>
 #include <libqalculate/Function.h>
 #include <libqalculate/MathStructure.h>
 #include <libqalculate/Number.h>
+#include <libqalculate/Prefix.h>
 #include <libqalculate/Unit.h>
 #include <libqalculate/Variable.h>
 #include <libqalculate/includes.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <limits>
+#include <memory>
 #include <lua5.1/lua.hpp>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 
 #include "util.hpp"
+#include "async.hpp"
+#include "batch.hpp"
+#include "buffer.hpp"
+#include "cache.hpp"
+#include "diskcache.hpp"
 #include "function.hpp"
 #include "opttbl.hpp"
+#include "program.hpp"
+#include "scope.hpp"
+#include "sheet.hpp"
+#include "stats.hpp"
 
 auto constexpr infini = std::numeric_limits<double>::infinity();
 
+// Owns a Calculator. Calculator handles and the expressions created
+// from them each hold a reference, the last one deletes it.
+struct CalculatorRef {
+    Calculator* calc;
+    VariableScope* active_scope; // nullable, only used by the shared calculator
+    int refs;
+    Stats stats;
+    PlotTarget plot; // read by the calculator's plot() function
+    // bumped whenever variables may have changed, invalidates the cached results of every handle
+    unsigned long epoch;
+    // eval_async jobs of any handle that assign and were not dispatched yet
+    int assigning;
+};
+
+// input of an eval with source = "lazy", parsed again by expr:source()
+struct LazySource {
+    std::string expr;
+    ParseOptions opts;
+};
+
+// strings printed from an expression and its source, see print_memoized
+struct PrintMemo {
+    struct Slot {
+        size_t hash;
+        std::string key; // print_options_key, plus whether the source was printed
+        std::string text;
+    };
+
+    Slot slots[4];
+    size_t used = 0;
+    size_t next = 0; // slot to replace once all are used
+};
+
 struct LMathStructure {
-    MathStructure* expr;
+    MathStructure* expr;       // usually points to storage, NULL once freed
     MathStructure* parsed_src; // nullable
-    Calculator* calc;
+    LazySource* lazy_src;      // nullable
+    PrintMemo* memo;           // nullable
+    CalculatorRef* ref;
+    int precision; // calculated with, set again to print it
+    // for views, which point expr into a part of the owner expression and keep it alive
+    LMathStructure* owner; // nullable
+    int owner_ref;
+    int views; // number of views into this expression
+    // the result itself, saving an allocation per expression, see new_MathStructure.
+    // Not allocated for views.
+    alignas(MathStructure) unsigned char storage[sizeof(MathStructure)];
 };
 
 struct LCalculator {
-    Calculator* calc;
+    Calculator* calc;   // NULL until first use with definitions = "lazy"
+    CalculatorRef* ref; // NULL together with calc
+    bool exchange_rates;
+    std::thread* loader; // nullable, loading definitions in the background
+    // set if calc is the shared calculator, which only shows the variables of the scope it was locked for
+    bool shared;
+    VariableScope* scope;
     int plot_function;
+    AsyncEvaluator* async; // nullable, created by the first eval_async
+    ResultCache* cache;
+    DiskCache* disk; // nullable, enabled by set_disk_cache
+    // set by set_options, the base of every eval's options
+    EvaluationOptions* eopts;
+    int precision;
+};
+
+// calls of a compiled function checked against libqalculate before trusting the fast path
+#define COMPILED_VERIFY_CALLS 8
+
+struct LCompiled {
+    MathStructure* expr; // parsed, not evaluated
+    std::vector<MathStructure>* args;
+    EvaluationOptions* eopts;
+    int precision; // the calculator's precision when compiled, set before every evaluation by libqalculate
+    Program* program; // nullable, set if expr has a double precision equivalent
+    int verified;     // calls of program that were checked against exact evaluation
+    LCalculator* owner;
+    int owner_ref; // keeps the calculator alive
+};
+
+struct SheetLine {
+    std::string text;
+    LineNames names;
+    int result; // registry reference to the QalcExpression
 };
 
+struct LSheet {
+    std::vector<SheetLine>* lines;
+    int opts_ref; // the parse options, LUA_NOREF for the defaults
+    bool do_assignment;
+    LCalculator* owner;
+    int owner_ref; // keeps the calculator alive
+};
+
+static LMathStructure* check_MathStructure(lua_State* L, int index) {
+    LMathStructure* res = (LMathStructure*)luaL_checkudata(L, index, "QalcExpression");
+    if (!res->expr) {
+        luaL_argerror(L, index, "expression was freed");
+    }
+    return res;
+}
+
 static MathStructure check_MathValue(Calculator* calc, lua_State* L, int index) {
     int type = lua_type(L, index);
     switch (type) {
@@ -36,7 +148,7 @@ static MathStructure check_MathValue(Calculator* calc, lua_State* L, int index)
     case LUA_TSTRING:
         return calc->parse(check_cppstr(L, index));
     case LUA_TUSERDATA:
-        return *((LMathStructure*)luaL_checkudata(L, index, "QalcExpression"))->expr;
+        return *check_MathStructure(L, index)->expr;
         break;
     default:
         luaL_argerror(L, index, "Must be a number or string");
@@ -48,10 +160,183 @@ static LCalculator* check_Calculator(lua_State* L, int index) {
     return (LCalculator*)luaL_checkudata(L, index, "QalcCalculator");
 }
 
-static LMathStructure* check_MathStructure(lua_State* L, int index) {
-    return (LMathStructure*)luaL_checkudata(L, index, "QalcExpression");
+static LCompiled* check_Compiled(lua_State* L, int index) {
+    return (LCompiled*)luaL_checkudata(L, index, "QalcCompiled");
+}
+
+static LSheet* check_Sheet(lua_State* L, int index) {
+    return (LSheet*)luaL_checkudata(L, index, "QalcSheet");
+}
+
+// the calculator of all handles created with shared = true, nullable
+static CalculatorRef* shared_calculator = NULL;
+static std::vector<Calculator*> live_calculators;
+
+// held by everything that uses a calculator or its results, see lock_Calculator
+static QalculateMutex qalculate_lock;
+
+static CalculatorRef* new_CalculatorRef() {
+    CalculatorRef* ref = new CalculatorRef;
+    ref->calc = new Calculator;
+    ref->active_scope = NULL;
+    ref->refs = 1;
+    ref->epoch = 0;
+    ref->assigning = 0;
+    live_calculators.push_back(ref->calc);
+    return ref;
+}
+
+static void release_Calculator(CalculatorRef* ref) {
+    if (--ref->refs > 0) {
+        return;
+    }
+
+    std::lock_guard<QalculateMutex> lock(qalculate_lock);
+    live_calculators.erase(std::find(live_calculators.begin(), live_calculators.end(), ref->calc));
+
+    // libqalculate reaches its calculator through the CALCULATOR global, also while
+    // tearing it down. Afterwards it must not be left dangling for the ones still alive.
+    CALCULATOR = ref->calc;
+    delete ref->calc;
+    CALCULATOR = live_calculators.empty() ? NULL : live_calculators.back();
+
+    if (shared_calculator == ref) {
+        shared_calculator = NULL;
+    }
+    delete ref;
+}
+
+// expr is left NULL, to be set to either a MathStructure constructed in storage
+// (res->expr = new (res->storage) MathStructure(...)) or one allocated with new
+static LMathStructure* new_MathStructure(lua_State* L, CalculatorRef* ref, int precision) {
+    LMathStructure* res = (LMathStructure*)lua_newuserdata(L, sizeof(LMathStructure));
+    luaL_getmetatable(L, "QalcExpression");
+    lua_setmetatable(L, -2);
+
+    res->ref = ref;
+    res->ref->refs++;
+    res->ref->stats.add_objects(1, 1);
+    res->precision = precision;
+    res->expr = NULL;
+    res->parsed_src = NULL;
+    res->lazy_src = NULL;
+    res->memo = NULL;
+    res->owner = NULL;
+    res->owner_ref = LUA_NOREF;
+    res->views = 0;
+    return res;
+}
+
+// pushes a view of part, which must be a part of the expression at index
+static LMathStructure* push_ExpressionView(lua_State* L, int index, MathStructure* part) {
+    LMathStructure* self = check_MathStructure(L, index);
+    LMathStructure* owner = self->owner ? self->owner : self;
+
+    LMathStructure* res = (LMathStructure*)lua_newuserdata(L, offsetof(LMathStructure, storage));
+    luaL_getmetatable(L, "QalcExpression");
+    lua_setmetatable(L, -2);
+
+    res->ref = owner->ref;
+    res->ref->refs++;
+    res->ref->stats.add_objects(0, 1);
+    res->precision = owner->precision;
+    res->expr = part;
+    res->parsed_src = NULL;
+    res->lazy_src = NULL;
+    res->memo = NULL;
+    res->views = 0;
+
+    res->owner = owner;
+    if (self->owner) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->owner_ref);
+    } else {
+        lua_pushvalue(L, index);
+    }
+    res->owner_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    owner->views++;
+    return res;
+}
+
+static void free_MathStructure(lua_State* L, LMathStructure* self) {
+    // the structures may reference variables of the calculator, used by an eval_async worker
+    std::lock_guard<QalculateMutex> lock(qalculate_lock);
+    if (self->owner) {
+        self->owner->views--;
+        self->owner = NULL;
+        luaL_unref(L, LUA_REGISTRYINDEX, self->owner_ref);
+        self->owner_ref = LUA_NOREF;
+    } else if (self->expr == (MathStructure*)self->storage) {
+        self->expr->~MathStructure();
+    } else {
+        delete self->expr;
+    }
+    self->expr = NULL;
+
+    delete self->parsed_src;
+    self->parsed_src = NULL;
+    delete self->lazy_src;
+    self->lazy_src = NULL;
+    delete self->memo;
+    self->memo = NULL;
+
+    // after the structures above, they may still reference variables of the calculator
+    if (self->ref) {
+        release_Calculator(self->ref);
+        self->ref = NULL;
+    }
+}
+
+// call with the calculator locked
+static void activate_Scope(LCalculator* self) {
+    if (!self->scope || self->ref->active_scope == self->scope) {
+        return;
+    }
+
+    if (self->ref->active_scope) {
+        self->ref->active_scope->deactivate();
+    }
+    self->scope->activate();
+    self->ref->active_scope = self->scope;
 }
 
+// A plot handler runs while eval holds the calculator's lock, locking it again
+// from the handler would wait forever. Raises a Lua error instead.
+static void check_not_plotting(lua_State* L, CalculatorRef* ref) {
+    // only PlotScope sets L, and only Lua on this thread could have called us meanwhile
+    if (ref->plot.L) {
+        luaL_error(L, "the calculator cannot be used from its own plot handler");
+    }
+}
+
+// waits until nothing else (a running eval_async job of any calculator or another
+// handle of the shared calculator) is using libqalculate
+static std::unique_lock<QalculateMutex> lock_Calculator(lua_State* L, LCalculator* self) {
+    check_not_plotting(L, self->ref);
+    std::unique_lock<QalculateMutex> lock(qalculate_lock);
+    activate_Scope(self);
+    return lock;
+}
+
+// lock_Calculator for the methods of an expression, which print and look
+// into structures that refer to the calculator
+static std::unique_lock<QalculateMutex> lock_Expression(lua_State* L, LMathStructure* self) {
+    check_not_plotting(L, self->ref);
+    return std::unique_lock<QalculateMutex>(qalculate_lock);
+}
+
+// points the calculator's plot() at the handler of self until the end of the scope,
+// construct with the calculator locked
+struct PlotScope {
+    PlotTarget& target;
+
+    PlotScope(lua_State* L, LCalculator* self) : target(self->ref->plot) {
+        target.L = L;
+        target.handler = self->plot_function;
+        target.stats = &self->ref->stats;
+    }
+    ~PlotScope() { target = PlotTarget(); }
+};
+
 const std::string type_names[] = {
     "multiplication", "inverse",  "division", "addition", "negation",   "power",     "number",  "unit",
     "symbolic",       "function", "variable", "vector",   "bitand",     "bitor",     "bitxor",  "bitnot",
@@ -68,12 +353,22 @@ static double num_value(Number const& num) {
     }
 }
 
+static bool is_real_vector(MathStructure const& expr) {
+    for (size_t i = 0; i < expr.countChildren(); i++) {
+        if (!expr[i].isNumber() || expr[i].number().isComplex()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int push_MathStructureValue(lua_State* L, MathStructure const& expr, Calculator const* calc,
-                                   PrintOptions const& opts) {
+                                   PrintOptions const& opts, bool buffers, Stats* stats) {
     if (expr.isNumber()) {
         Number num = expr.number();
         if (num.isComplex()) {
             lua_createtable(L, 3, 0);
+            stats->add_objects(0, 2);
 
             push_cppstr(L, "complex");
             lua_rawseti(L, -2, 1);
@@ -89,11 +384,21 @@ static int push_MathStructureValue(lua_State* L, MathStructure const& expr, Calc
         return 1;
     }
 
+    if (expr.isVector() && buffers && is_real_vector(expr)) {
+        LBuffer* buf = new_Buffer(L, expr.countChildren());
+        stats->add_objects(0, 1);
+        for (size_t i = 0; i < buf->len; i++) {
+            buf->data()[i] = num_value(expr[i].number());
+        }
+        return 1;
+    }
+
     if (expr.isVector()) {
         lua_createtable(L, expr.countChildren(), 0);
+        stats->add_objects(0, 1);
 
         for (int i = 0; i < expr.countChildren(); i++) {
-            push_MathStructureValue(L, expr[i], calc, opts);
+            push_MathStructureValue(L, expr[i], calc, opts, buffers, stats);
             lua_rawseti(L, -2, i + 1);
         }
 
@@ -101,6 +406,7 @@ static int push_MathStructureValue(lua_State* L, MathStructure const& expr, Calc
     }
 
     lua_newtable(L);
+    stats->add_objects(0, expr.isUnit() ? 4 : expr.isVariable() || expr.isSymbolic() ? 3 : 2);
     int i = 0;
     push_cppstr(L, type_names[expr.type()]);
     lua_rawseti(L, -2, i++ + 1);
@@ -116,7 +422,7 @@ static int push_MathStructureValue(lua_State* L, MathStructure const& expr, Calc
         lua_rawseti(L, -2, i++ + 1);
     } else {
         for (; (i - 1) < expr.countChildren(); i++) {
-            push_MathStructureValue(L, expr[i - 1], calc, opts);
+            push_MathStructureValue(L, expr[i - 1], calc, opts, buffers, stats);
             lua_rawseti(L, -2, i + 1);
         }
     }
@@ -124,7 +430,76 @@ static int push_MathStructureValue(lua_State* L, MathStructure const& expr, Calc
     return 1;
 }
 
+// the columns of expr:flatten(), one entry per node of a tree in preorder
+struct FlatTree {
+    std::vector<double> types;
+    std::vector<double> children;
+    std::vector<double> values; // number (real part), comparison type or index into strings
+    std::vector<double> imag;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, size_t> string_ids;
+
+    // 1-based index of s in strings
+    double intern(std::string const& s) {
+        auto it = string_ids.emplace(s, strings.size() + 1);
+        if (it.second) {
+            strings.push_back(s);
+        }
+        return it.first->second;
+    }
+
+    void add(MathStructure const& expr) {
+        double value = NAN;
+        double im = 0;
+        switch (expr.type()) {
+        case STRUCT_NUMBER:
+            if (expr.number().isComplex()) {
+                value = num_value(expr.number().realPart());
+                im = num_value(expr.number().imaginaryPart());
+            } else {
+                value = num_value(expr.number());
+            }
+            break;
+        case STRUCT_UNIT:
+            if (expr.prefix()) {
+                value = intern(expr.prefix()->shortName() + expr.unit()->abbreviation());
+            } else {
+                value = intern(expr.unit()->abbreviation());
+            }
+            break;
+        case STRUCT_VARIABLE:
+            value = intern(expr.variable()->referenceName());
+            break;
+        case STRUCT_FUNCTION:
+            value = intern(expr.function()->referenceName());
+            break;
+        case STRUCT_SYMBOLIC:
+            value = intern(expr.symbol());
+            break;
+        case STRUCT_COMPARISON:
+            value = expr.comparisonType();
+            break;
+        default:
+            break;
+        }
+
+        types.push_back(expr.type());
+        children.push_back(expr.countChildren());
+        values.push_back(value);
+        imag.push_back(im);
+
+        for (size_t i = 0; i < expr.countChildren(); i++) {
+            add(expr[i]);
+        }
+    }
+};
+
 #define MESSAGE_TO_VIM_LOG_LEVELS 2
+static PrintOptions check_PrintOptions(lua_State* L, int index, Stats* stats) {
+    StatTimer timer(stats, STAT_OPTIONS);
+    return check_PrintOptions(L, index);
+}
+
 static int push_messages(lua_State* L, Calculator* calc) {
     if (!calc->message()) {
         return 0;
@@ -149,13 +524,90 @@ static int push_messages(lua_State* L, Calculator* calc) {
     return 1;
 }
 
-int QALC_CURRENT_PLOT_HANDLER = 0;
-lua_State* QALC_CURRENT_LUA_STATE = NULL;
+static int push_MessageList(lua_State* L, MessageList const& messages) {
+    if (messages.empty()) {
+        return 0;
+    }
+
+    lua_createtable(L, messages.size(), 0);
+    for (size_t i = 0; i < messages.size(); i++) {
+        lua_createtable(L, 2, 0);
+
+        push_cppstr(L, messages[i].first);
+        lua_rawseti(L, -2, 1);
+
+        lua_pushinteger(L, messages[i].second + MESSAGE_TO_VIM_LOG_LEVELS);
+        lua_rawseti(L, -2, 2);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
 
 extern "C" {
 #include <lua5.1/lauxlib.h>
 #include <lua5.1/lua.h>
 
+static void load_definitions(Calculator* calc, bool exchange_rates, PlotTarget* plot) {
+    if (exchange_rates) {
+        calc->loadExchangeRates();
+    }
+    calc->loadGlobalDefinitions();
+    calc->loadLocalDefinitions();
+
+    // override builtin plot to call a lua handler
+    calc->addFunction(new ReturnPlotFunction(plot));
+}
+
+// The handle whose definitions are being loaded on a thread, nullable. libqalculate is not
+// safe to use from two threads at once, so there is at most one and only while no other
+// calculator exists.
+static LCalculator* loading_calculator = NULL;
+
+static void join_loader(LCalculator* self) {
+    if (self->loader) {
+        self->loader->join();
+        delete self->loader;
+        self->loader = NULL;
+        loading_calculator = NULL;
+    }
+}
+
+// creates the calculator or waits for its definitions, whatever new() deferred
+static Calculator* ensure_Calculator(LCalculator* self) {
+    join_loader(self);
+    if (self->calc) {
+        return self->calc;
+    }
+
+    // constructing a calculator would race with another handle's loader, e.g. of
+    // qalculate.default, which is lazy and may be used first while that one loads
+    if (loading_calculator) {
+        join_loader(loading_calculator);
+    }
+
+    std::lock_guard<QalculateMutex> lock(qalculate_lock);
+    if (self->shared) {
+        if (!shared_calculator) {
+            shared_calculator = new_CalculatorRef();
+            load_definitions(shared_calculator->calc, self->exchange_rates, &shared_calculator->plot);
+        } else {
+            shared_calculator->refs++;
+        }
+
+        self->ref = shared_calculator;
+        self->calc = self->ref->calc;
+        self->scope = new VariableScope(self->calc);
+    } else {
+        self->ref = new_CalculatorRef();
+        self->calc = self->ref->calc;
+        load_definitions(self->calc, self->exchange_rates, &self->ref->plot);
+    }
+
+    return self->calc;
+}
+
 int l_calc_new(lua_State* L) {
     int funcref = 0;
     if (lua_isfunction(L, 1)) {
@@ -163,17 +615,53 @@ int l_calc_new(lua_State* L) {
         funcref = luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
+    bool exchange_rates = true;
+    bool shared = false;
+    std::string definitions = "eager";
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "exchange_rates");
+        exchange_rates = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_getfield(L, 2, "shared");
+        shared = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "definitions");
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            definitions = lua_tostring(L, -1);
+        }
+        lua_pop(L, 3);
+    }
+    if (definitions != "eager" && definitions != "lazy" && definitions != "background") {
+        luaL_argerror(L, 2, "definitions must be eager, lazy or background");
+    }
+
     LCalculator* udata = (LCalculator*)lua_newuserdata(L, sizeof(LCalculator));
-    Calculator* calc = new Calculator;
-    udata->calc = calc;
+    udata->calc = NULL;
+    udata->ref = NULL;
+    udata->exchange_rates = exchange_rates;
+    udata->loader = NULL;
+    udata->shared = shared;
+    udata->scope = NULL;
     udata->plot_function = funcref;
+    udata->async = NULL;
+    udata->cache = new ResultCache(64);
+    udata->disk = NULL;
+    udata->eopts = new EvaluationOptions(default_evaluation_options);
+    udata->precision = DEFAULT_PRECISION;
+
+    // constructing a calculator would race with the loader
+    if (loading_calculator) {
+        join_loader(loading_calculator);
+    }
 
-    calc->loadExchangeRates();
-    calc->loadGlobalDefinitions();
-    calc->loadLocalDefinitions();
-
-    // override builtin plot to call a lua handler
-    MathFunction* func = calc->addFunction(new ReturnPlotFunction());
+    if (definitions == "eager" || (shared && definitions == "background")) {
+        ensure_Calculator(udata);
+    } else if (definitions == "background" && live_calculators.empty()) {
+        // constructed here, as the constructor makes itself the CALCULATOR global
+        udata->ref = new_CalculatorRef();
+        udata->calc = udata->ref->calc;
+        udata->loader = new std::thread(load_definitions, udata->calc, exchange_rates, &udata->ref->plot);
+        loading_calculator = udata;
+    }
+    // with other calculators alive, background loading falls back to lazy
 
     luaL_getmetatable(L, "QalcCalculator");
     lua_setmetatable(L, -2);
@@ -185,60 +673,406 @@ int l_calc_gc(lua_State* L) {
     if (self->plot_function) {
         luaL_unref(L, LUA_REGISTRYINDEX, self->plot_function);
     }
-    // FIXME: find out why this leads to a double free
-    // as far as I can see, nothing in my code should be the cause
-    // delete self->calc;
+    join_loader(self);
+    if (self->async) {
+        self->async->stop();
+        while (auto res = self->async->next()) {
+            if (res->assigns) {
+                self->ref->epoch++;
+                self->ref->assigning--;
+            }
+            luaL_unref(L, LUA_REGISTRYINDEX, res->callback);
+            delete res->expr;
+            delete res->parsed_src;
+        }
+        delete self->async;
+        self->async = NULL;
+    }
+    delete self->cache;
+    self->cache = NULL;
+    delete self->disk;
+    self->disk = NULL;
+    delete self->eopts;
+    self->eopts = NULL;
+
+    if (self->scope) {
+        std::lock_guard<QalculateMutex> lock(qalculate_lock);
+        if (self->ref->active_scope == self->scope) {
+            self->scope->deactivate();
+            self->ref->active_scope = NULL;
+        }
+        delete self->scope;
+        self->scope = NULL;
+    }
+    if (self->ref) {
+        // expressions created from this calculator may keep it alive
+        release_Calculator(self->ref);
+        self->ref = NULL;
+        self->calc = NULL;
+    }
     return 0;
 }
 
+// libqalculate keeps the precision in the Calculator, set it for the next calculation.
+// Call with the calculator locked.
+static void use_precision(Calculator* calc, int precision) {
+    if (calc->getPrecision() != precision) {
+        calc->setPrecision(precision);
+    }
+}
+
+// what calculate_limited calculates
+struct CalcInput {
+    std::string const& text;
+    MathStructure const* parsed; // nullable, text parsed already without its to part
+    std::string to;
+};
+
+// calculate() within call.timeout_ms, returning an aborted result if that isn't enough.
+// complete is set to false if the result is aborted or only approximate because of the timeout.
+static MathStructure calculate_limited(Calculator* calc, CalcInput const& input, EvaluationOptions const& eo,
+                                       MathStructure* parsed, CallOptions const& call, MessageList& messages,
+                                       bool* complete) {
+    auto calculate = [&](EvaluationOptions const& options) {
+        if (!input.parsed) {
+            return calc->calculate(input.text, options, parsed);
+        }
+        if (parsed) {
+            *parsed = *input.parsed;
+        }
+        return calc->calculate(*input.parsed, options, input.to);
+    };
+
+    *complete = true;
+    if (call.timeout_ms <= 0) {
+        MathStructure res = calculate(eo);
+        messages = collect_messages(calc);
+        return res;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    calc->startControl(call.timeout_ms);
+    MathStructure res = calculate(eo);
+    bool timed_out = res.isAborted();
+    calc->stopControl();
+
+    bool approximated = false;
+    if (timed_out && call.fallback == FALLBACK_APPROXIMATE) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        if (elapsed.count() < call.timeout_ms) {
+            EvaluationOptions approximate = eo;
+            approximate.approximation = APPROXIMATION_APPROXIMATE;
+
+            calc->startControl(call.timeout_ms - elapsed.count());
+            res = calculate(approximate);
+            timed_out = res.isAborted();
+            calc->stopControl();
+            approximated = !timed_out;
+        }
+    }
+    messages = collect_messages(calc);
+
+    if (timed_out) {
+        res.setAborted();
+        messages.push_back({"calculation timed out after " + std::to_string(call.timeout_ms) + " ms", MESSAGE_WARNING});
+    } else if (approximated) {
+        messages.push_back({"exact calculation timed out, the result is approximate", MESSAGE_WARNING});
+    }
+    *complete = !timed_out && !approximated;
+    return res;
+}
+
 int l_calc_eval(lua_State* L) {
     LCalculator* self = check_Calculator(L, 1);
-
-    QALC_CURRENT_LUA_STATE = L;
-    QALC_CURRENT_PLOT_HANDLER = self->plot_function;
+    ensure_Calculator(self);
+    Stats* stats = &self->ref->stats;
+    StatTimer timer(stats, STAT_EVAL);
 
     auto expr = check_cppstr(L, 2);
-    ParseOptions opts = check_ParseOptions(L, 3);
-    EvaluationOptions eopts = default_evaluation_options;
-    eopts.parse_options = opts;
+    EvaluationOptions eopts;
+    int precision = self->precision;
+    CallOptions call;
+    {
+        StatTimer options_timer(stats, STAT_OPTIONS);
+        eopts = check_EvaluationOptions(L, 3, *self->eopts, &precision);
+        eopts.parse_options = check_ParseOptions(L, 3);
+        call = check_CallOptions(L, 3);
+    }
+    ParseOptions const& opts = eopts.parse_options;
 
     bool do_assignment = lua_toboolean(L, 4);
     if (do_assignment) {
         transform_expression_for_equals_save(expr, opts);
     }
 
-    LMathStructure* res = (LMathStructure*)lua_newuserdata(L, sizeof(LMathStructure));
-    luaL_getmetatable(L, "QalcExpression");
-    lua_setmetatable(L, -2);
+    auto lock = lock_Calculator(L, self);
+    PlotScope plot(L, self);
+
+    bool assigns = do_assignment || expr.find(":=") != std::string::npos;
+    std::string key;
+    // until an assigning eval_async is dispatched, neither old nor new values are safe to cache
+    bool assigning = self->ref->assigning > 0;
+    if (!assigns && !assigning && self->cache->capacity() > 0) {
+        key = expr;
+        key.push_back('\0');
+        key += options_key(eopts, precision);
+    }
 
-    res->calc = self->calc;
-    res->expr = new MathStructure;
-    res->parsed_src = new MathStructure;
-    *res->expr = self->calc->calculate(expr, eopts, res->parsed_src);
+    LMathStructure* res = new_MathStructure(L, self->ref, precision);
+    if (call.source == SOURCE_LAZY) {
+        res->lazy_src = new LazySource{expr, opts};
+    }
 
-    QALC_CURRENT_LUA_STATE = NULL;
-    QALC_CURRENT_PLOT_HANDLER = 0;
+    if (!key.empty()) {
+        if (CachedResult const* hit = self->cache->find(key, self->ref->epoch)) {
+            res->expr = new (res->storage) MathStructure(hit->expr);
+            if (call.source == SOURCE_KEEP) {
+                res->parsed_src = new MathStructure(hit->parsed_src);
+                stats->add_objects(1, 0);
+            }
+            return 1 + push_MessageList(L, hit->messages);
+        }
+    }
 
-    return 1 + push_messages(L, self->calc);
+    size_t first_new_variable = self->calc->variables.size();
+    use_precision(self->calc, precision);
+
+    // results that took long are also kept on disk, keyed by the parsed input
+    CalcInput input = {expr, NULL, ""};
+    std::string disk_key;
+    MathStructure disk_parsed;
+    if (self->disk && !assigns &&
+        parse_for_disk_cache(self->calc, expr, eopts, options_key(eopts, precision), disk_parsed, input.to, disk_key)) {
+        input.parsed = &disk_parsed;
+
+        MathStructure stored;
+        MessageList stored_messages;
+        if (!disk_key.empty() && self->disk->find(disk_key, self->calc, stored, stored_messages)) {
+            // the stored messages include those of parsing
+            self->calc->clearMessages();
+            res->expr = new (res->storage) MathStructure(stored);
+            if (call.source == SOURCE_KEEP) {
+                res->parsed_src = new MathStructure(disk_parsed);
+                stats->add_objects(1, 0);
+            }
+            if (!key.empty()) {
+                self->cache->insert(key, self->ref->epoch, {stored, disk_parsed, stored_messages});
+            }
+            return 1 + push_MessageList(L, stored_messages);
+        }
+    }
+
+    // the cache needs the parsed input even if the result doesn't keep it
+    MathStructure local_parsed;
+    MathStructure* parsed = NULL;
+    if (call.source == SOURCE_KEEP) {
+        parsed = res->parsed_src = new MathStructure;
+        stats->add_objects(1, 0);
+    } else if (!key.empty()) {
+        parsed = &local_parsed;
+    }
+
+    MessageList messages;
+    bool complete;
+    auto started = std::chrono::steady_clock::now();
+    {
+        StatTimer calculate_timer(stats, STAT_CALCULATE);
+        res->expr = new (res->storage)
+            MathStructure(calculate_limited(self->calc, input, eopts, parsed, call, messages, &complete));
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+    if (assigns) {
+        if (self->scope) {
+            self->scope->adopt(first_new_variable);
+        }
+        self->ref->epoch++;
+    } else if (!key.empty() && complete && !res->expr->isAborted() && is_cacheable(*parsed)) {
+        self->cache->insert(key, self->ref->epoch, {*res->expr, *parsed, messages});
+    }
+    if (!disk_key.empty() && complete && !res->expr->isAborted() && elapsed.count() >= self->disk->min_ms()) {
+        self->disk->insert(disk_key, *res->expr, messages);
+    }
+
+    return 1 + push_MessageList(L, messages);
+}
+
+int l_calc_eval_async(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+    auto expr = check_cppstr(L, 2);
+    int precision = self->precision;
+    EvaluationOptions eopts = check_EvaluationOptions(L, 3, *self->eopts, &precision);
+    eopts.parse_options = check_ParseOptions(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    if (!self->async) {
+        self->async = new AsyncEvaluator(self->calc, qalculate_lock, self->ref->plot);
+    }
+
+    lua_pushvalue(L, 4);
+    int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    bool assigns = expr.find(":=") != std::string::npos;
+    // variables the job defines on the shared calculator belong to the scope of this handle,
+    // it has to take them before another handle can lock the calculator
+    auto first_new_variable = std::make_shared<size_t>(0);
+    auto prepare = [self, precision, first_new_variable] {
+        activate_Scope(self);
+        use_precision(self->calc, precision);
+        *first_new_variable = self->calc->variables.size();
+    };
+    std::function<void()> finish;
+    if (assigns && self->scope) {
+        finish = [self, first_new_variable] { self->scope->adopt(*first_new_variable); };
+    }
+    if (assigns) {
+        self->ref->assigning++;
+    }
+    if (auto dropped = self->async->submit({expr, eopts, callback, assigns, precision, prepare, finish})) {
+        luaL_unref(L, LUA_REGISTRYINDEX, dropped->callback);
+        if (dropped->assigns) {
+            self->ref->assigning--;
+        }
+    }
+
+    return 0;
+}
+
+int l_calc_eval_batch(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    Stats* stats = &self->ref->stats;
+    StatTimer timer(stats, STAT_EVAL);
+
+    int precision = self->precision;
+    EvaluationOptions eopts = check_EvaluationOptions(L, 3, *self->eopts, &precision);
+    eopts.parse_options = check_ParseOptions(L, 3);
+    CallOptions call = check_CallOptions(L, 3);
+
+    std::vector<std::string> exprs;
+    size_t count = lua_objlen(L, 2);
+    bool assigns = false;
+    for (size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "expression %d is not a string", (int)i + 1);
+        }
+        exprs.push_back(check_cppstr(L, -1));
+        assigns = assigns || exprs.back().find(":=") != std::string::npos;
+        lua_pop(L, 1);
+    }
+
+    std::vector<BatchResult> results;
+    {
+        auto lock = lock_Calculator(L, self);
+        use_precision(self->calc, precision);
+        size_t first_new_variable = self->calc->variables.size();
+        {
+            StatTimer calculate_timer(stats, STAT_CALCULATE);
+            // the timeout applies to each expression on its own
+            auto calculate = [&](std::string const& expr, MathStructure* parsed, MessageList& messages) {
+                bool complete;
+                return calculate_limited(self->calc, {expr, NULL, ""}, eopts, parsed, call, messages, &complete);
+            };
+            results = evaluate_batch(self->calc, exprs, calculate, call.source == SOURCE_KEEP);
+        }
+        if (assigns) {
+            if (self->scope) {
+                self->scope->adopt(first_new_variable);
+            }
+            self->ref->epoch++;
+        }
+    }
+
+    lua_createtable(L, count, 0);
+    lua_createtable(L, count, 0);
+    for (size_t i = 0; i < count; i++) {
+        LMathStructure* udata = new_MathStructure(L, self->ref, precision);
+        udata->expr = results[i].expr;
+        udata->parsed_src = results[i].parsed_src;
+        if (call.source == SOURCE_LAZY) {
+            udata->lazy_src = new LazySource{exprs[i], eopts.parse_options};
+        }
+        lua_rawseti(L, -3, i + 1);
+
+        if (!push_MessageList(L, results[i].messages)) {
+            lua_newtable(L);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    stats->add_objects(call.source == SOURCE_KEEP ? 2 * count : count, 2 + 2 * count);
+    return 2;
+}
+
+int l_calc_async_fd(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+    if (!self->async) {
+        self->async = new AsyncEvaluator(self->calc, qalculate_lock, self->ref->plot);
+    }
+
+    lua_pushinteger(L, self->async->fd());
+    return 1;
+}
+
+int l_calc_dispatch(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    if (!self->async) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    while (auto res = self->async->next()) {
+        if (res->assigns) {
+            // results cached before it may be stale now
+            self->ref->epoch++;
+            self->ref->assigning--;
+        }
+        if (res->superseded) {
+            luaL_unref(L, LUA_REGISTRYINDEX, res->callback);
+            delete res->expr;
+            delete res->parsed_src;
+            continue;
+        }
+
+        if (self->plot_function) {
+            for (PlotData const& plot : res->plots) {
+                call_PlotHandler(L, self->plot_function, plot, &self->ref->stats, true);
+            }
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, res->callback);
+        luaL_unref(L, LUA_REGISTRYINDEX, res->callback);
+
+        LMathStructure* udata = new_MathStructure(L, self->ref, res->precision);
+        udata->expr = res->expr;
+        udata->parsed_src = res->parsed_src;
+
+        if (!push_MessageList(L, res->messages)) {
+            lua_pushnil(L);
+        }
+        lua_call(L, 2, 0);
+    }
+
+    lua_pushinteger(L, self->async->pending());
+    return 1;
 }
 
 int l_calc_getvar(lua_State* L) {
     LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
     std::string name = check_cppstr(L, 2);
+    auto lock = lock_Calculator(L, self);
 
     Variable* var = self->calc->getActiveVariable(name);
     if (!var) {
         lua_pushnil(L);
     } else {
-        LMathStructure* res = (LMathStructure*)lua_newuserdata(L, sizeof(LMathStructure));
-        luaL_getmetatable(L, "QalcExpression");
-        lua_setmetatable(L, -2);
-
-        res->calc = self->calc;
-        MathStructure* expr = new MathStructure(var);
-        expr->eval();
-        res->expr = expr;
-        res->parsed_src = NULL;
+        LMathStructure* res = new_MathStructure(L, self->ref, self->precision);
+        res->expr = new (res->storage) MathStructure(var);
+        res->expr->eval();
     }
 
     return 1;
@@ -246,15 +1080,22 @@ int l_calc_getvar(lua_State* L) {
 
 int l_calc_setvar(lua_State* L) {
     LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
     std::string name = check_cppstr(L, 2);
+    auto lock = lock_Calculator(L, self);
     MathStructure val = check_MathValue(self->calc, L, 3);
 
-    Variable* var = self->calc->getVariable(name);
+    Variable* var = self->scope ? self->scope->find(name) : self->calc->getVariable(name);
+    self->ref->epoch++;
     if (!var) {
         KnownVariable* v = new KnownVariable();
         v->setName(name);
         v->set(val);
-        self->calc->addVariable(v);
+        if (self->scope) {
+            self->scope->add(v);
+        } else {
+            self->calc->addVariable(v);
+        }
         lua_pushboolean(L, true);
     } else if (var->isKnown()) {
         KnownVariable* v = (KnownVariable*)var;
@@ -268,52 +1109,619 @@ int l_calc_setvar(lua_State* L) {
 
 int l_calc_reset(lua_State* L) {
     LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
     bool variables = lua_toboolean(L, 2);
-    if (variables)
+    auto lock = lock_Calculator(L, self);
+    if (variables && self->scope)
+        self->scope->clear();
+    else if (variables)
         self->calc->resetVariables();
 
+    self->ref->epoch++;
     return 0;
 }
 
-int l_expr_gc(lua_State* L) {
-    LMathStructure* expr = check_MathStructure(L, 1);
+int l_calc_cache_stats(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, self->cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, self->cache->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, self->cache->size());
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, self->cache->capacity());
+    lua_setfield(L, -2, "capacity");
+
+    if (self->disk) {
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, self->disk->hits);
+        lua_setfield(L, -2, "hits");
+        lua_pushinteger(L, self->disk->misses);
+        lua_setfield(L, -2, "misses");
+        lua_pushinteger(L, self->disk->size());
+        lua_setfield(L, -2, "size");
+        lua_pushinteger(L, self->disk->bytes());
+        lua_setfield(L, -2, "bytes");
+        lua_setfield(L, -2, "disk");
+    }
+    return 1;
+}
+
+int l_calc_stats(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+    Stats const& stats = self->ref->stats;
+
+    lua_createtable(L, 0, STAT_PHASE_COUNT + 3);
+    lua_pushboolean(L, stats.enabled);
+    lua_setfield(L, -2, "enabled");
+    lua_pushnumber(L, stats.math_structures);
+    lua_setfield(L, -2, "math_structures");
+    lua_pushnumber(L, stats.lua_objects);
+    lua_setfield(L, -2, "lua_objects");
+
+    for (int i = 0; i < STAT_PHASE_COUNT; i++) {
+        Stats::Phase const& phase = stats.phases[i];
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, phase.calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, std::chrono::duration<double, std::milli>(phase.total).count());
+        lua_setfield(L, -2, "total_ms");
+        lua_pushnumber(L, std::chrono::duration<double, std::milli>(phase.max).count());
+        lua_setfield(L, -2, "max_ms");
+        lua_setfield(L, -2, stat_phase_names[i]);
+    }
+    return 1;
+}
+
+int l_calc_reset_stats(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+
+    if (!lua_isnoneornil(L, 2)) {
+        self->ref->stats.enabled = lua_toboolean(L, 2);
+    }
+    self->ref->stats.reset();
+    return 0;
+}
+
+int l_calc_set_options(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    *self->eopts = set_EvaluationOptions(L, 2, *self->eopts, &self->precision);
+    return 0;
+}
+
+int l_calc_set_cache_size(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    int size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "cache size must not be negative");
+
+    self->cache->resize(size);
+    return 0;
+}
+
+int l_calc_set_disk_cache(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    delete self->disk;
+    self->disk = NULL;
+    if (lua_isnoneornil(L, 2) || (lua_isboolean(L, 2) && !lua_toboolean(L, 2))) {
+        return 0;
+    }
+
+    std::string dir = default_disk_cache_dir();
+    lua_Number max_size = 64 << 20;
+    lua_Number min_ms = 100;
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "dir");
+        if (!lua_isnil(L, -1)) {
+            dir = check_cppstr(L, -1);
+        }
+        lua_getfield(L, 2, "max_size");
+        if (!lua_isnil(L, -1)) {
+            max_size = luaL_checknumber(L, -1);
+        }
+        lua_getfield(L, 2, "min_ms");
+        if (!lua_isnil(L, -1)) {
+            min_ms = luaL_checknumber(L, -1);
+        }
+        lua_pop(L, 3);
+    } else if (!lua_isboolean(L, 2)) {
+        luaL_typerror(L, 2, "table or boolean");
+    }
+    luaL_argcheck(L, max_size >= 0, 2, "max_size must not be negative");
+    luaL_argcheck(L, min_ms >= 0, 2, "min_ms must not be negative");
+
+    // converting a double out of range of the integer type is undefined, huge limits mean no limit
+    size_t max_bytes = max_size < (lua_Number)std::numeric_limits<size_t>::max()
+                           ? (size_t)max_size
+                           : std::numeric_limits<size_t>::max();
+    int min_time = min_ms < (lua_Number)std::numeric_limits<int>::max() ? (int)min_ms : std::numeric_limits<int>::max();
+
+    DiskCache* disk = new DiskCache(dir, max_bytes, min_time);
+    if (!disk->open()) {
+        delete disk;
+        return luaL_error(L, "cannot open the cache directory %s", dir.c_str());
+    }
+    self->disk = disk;
+    return 0;
+}
+
+int l_calc_compile(lua_State* L) {
+    LCalculator* self = check_Calculator(L, 1);
+    ensure_Calculator(self);
+    auto expr = check_cppstr(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int precision = self->precision;
+    EvaluationOptions eopts = check_EvaluationOptions(L, 4, *self->eopts, &precision);
+    eopts.parse_options = check_ParseOptions(L, 4);
+
+    std::vector<std::string> names;
+    for (size_t i = 1; i <= lua_objlen(L, 3); i++) {
+        lua_rawgeti(L, 3, i);
+        names.push_back(check_cppstr(L, -1));
+        lua_pop(L, 1);
+    }
+
+    auto lock = lock_Calculator(L, self);
+
+    LCompiled* res = (LCompiled*)lua_newuserdata(L, sizeof(LCompiled));
+    luaL_getmetatable(L, "QalcCompiled");
+    lua_setmetatable(L, -2);
+
+    res->args = new std::vector<MathStructure>;
+    std::vector<Variable*> added;
+    for (std::string const& name : names) {
+        Variable* var = self->calc->getActiveVariable(name);
+        if (!var) {
+            // so that the name parses as a single unknown instead of units or a product
+            var = self->calc->addVariable(new UnknownVariable("", name));
+            added.push_back(var);
+        }
+        res->args->push_back(MathStructure(var));
+    }
 
-    if (expr->expr != NULL) {
-        delete expr->expr;
-        expr->expr = NULL;
+    res->eopts = new EvaluationOptions(eopts);
+    res->precision = precision;
+    use_precision(self->calc, precision);
+    res->expr = new MathStructure(self->calc->parse(expr, eopts.parse_options));
+
+    // only needed for parsing, the structures above keep them alive
+    for (Variable* var : added) {
+        destroy_ExpressionItem(self->calc, var);
     }
 
-    if (expr->parsed_src != NULL) {
-        delete expr->parsed_src;
-        expr->expr = NULL;
+    res->program = new Program;
+    res->verified = 0;
+    if (!res->program->lower(*res->expr, *res->args, *res->eopts)) {
+        delete res->program;
+        res->program = NULL;
     }
 
+    res->owner = self;
+    lua_pushvalue(L, 1);
+    res->owner_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return 1 + push_messages(L, self->calc);
+}
+
+static std::vector<double> check_CompiledArgs(lua_State* L, LCompiled* self, int index) {
+    std::vector<double> args(self->args->size());
+    for (size_t i = 0; i < args.size(); i++) {
+        args[i] = luaL_checknumber(L, index + i);
+    }
+    return args;
+}
+
+// substitutes the arguments and evaluates with libqalculate, messages are cleared if not wanted.
+// approximate is for callers that want a double, an exact result such as sqrt(2) is no number.
+static MathStructure compiled_eval(lua_State* L, LCompiled* self, std::vector<double> const& args,
+                                   bool approximate, MessageList* messages) {
+    auto lock = lock_Calculator(L, self->owner);
+    MathStructure res = *self->expr;
+    for (size_t i = 0; i < args.size(); i++) {
+        res.replace((*self->args)[i], double_Number(args[i]));
+    }
+
+    use_precision(self->owner->calc, self->precision);
+    if (approximate) {
+        EvaluationOptions eo = *self->eopts;
+        eo.approximation = APPROXIMATION_APPROXIMATE;
+        res.eval(eo);
+    } else {
+        res.eval(*self->eopts);
+    }
+    if (messages) {
+        *messages = collect_messages(self->owner->calc);
+    } else {
+        self->owner->calc->clearMessages();
+    }
+    return res;
+}
+
+static double compiled_value(MathStructure const& res) {
+    if (res.isNumber() && !res.number().isComplex()) {
+        return num_value(res.number());
+    }
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+int l_compiled_call(lua_State* L) {
+    LCompiled* self = check_Compiled(L, 1);
+    std::vector<double> args = check_CompiledArgs(L, self, 2);
+
+    if (!self->program) {
+        lua_pushnumber(L, compiled_value(compiled_eval(L, self, args, true, NULL)));
+        return 1;
+    }
+
+    double value = self->program->run(args.data());
+    if (self->verified < COMPILED_VERIFY_CALLS) {
+        // the first calls decide whether the fast path agrees with libqalculate,
+        // later arguments are trusted to behave like these
+        double expected = compiled_value(compiled_eval(L, self, args, true, NULL));
+        bool agrees = (std::isnan(value) && std::isnan(expected)) || value == expected ||
+                      std::fabs(value - expected) <= 1e-9 * std::fmax(1, std::fabs(expected));
+        if (!agrees) {
+            delete self->program;
+            self->program = NULL;
+            value = expected;
+        }
+        self->verified++;
+    }
+
+    lua_pushnumber(L, value);
+    return 1;
+}
+
+int l_compiled_eval(lua_State* L) {
+    LCompiled* self = check_Compiled(L, 1);
+    std::vector<double> args = check_CompiledArgs(L, self, 2);
+
+    MessageList messages;
+    LMathStructure* res = new_MathStructure(L, self->owner->ref, self->precision);
+    res->expr = new (res->storage) MathStructure(compiled_eval(L, self, args, false, &messages));
+    return 1 + push_MessageList(L, messages);
+}
+
+int l_compiled_is_fast(lua_State* L) {
+    LCompiled* self = check_Compiled(L, 1);
+    lua_pushboolean(L, self->program != NULL);
+    return 1;
+}
+
+int l_compiled_gc(lua_State* L) {
+    LCompiled* self = check_Compiled(L, 1);
+
+    delete self->expr;
+    delete self->args;
+    delete self->eopts;
+    delete self->program;
+    self->expr = NULL;
+    self->args = NULL;
+    self->eopts = NULL;
+    self->program = NULL;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, self->owner_ref);
     return 0;
 }
 
+int l_calc_sheet(lua_State* L) {
+    check_Calculator(L, 1);
+
+    LSheet* res = (LSheet*)lua_newuserdata(L, sizeof(LSheet));
+    luaL_getmetatable(L, "QalcSheet");
+    lua_setmetatable(L, -2);
+
+    res->lines = new std::vector<SheetLine>;
+    res->do_assignment = lua_toboolean(L, 3);
+    res->opts_ref = LUA_NOREF;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_pushvalue(L, 2);
+        res->opts_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    res->owner = check_Calculator(L, 1);
+    lua_pushvalue(L, 1);
+    res->owner_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+// whether a line reads one of the changed names, or defines one and has to define it again
+static bool uses_any(LineNames const& names, std::unordered_set<std::string> const& changed) {
+    for (auto const* list : {&names.reads, &names.defines}) {
+        for (std::string const& name : *list) {
+            if (changed.count(name)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// removes what a line that is gone defined, call with the calculator locked
+static void undefine(LCalculator* self, std::string const& name) {
+    if (self->scope) {
+        self->scope->remove(name);
+    } else if (Variable* var = self->calc->getActiveVariable(name); var && var->isLocal()) {
+        destroy_ExpressionItem(self->calc, var);
+    }
+    if (MathFunction* fn = self->calc->getActiveFunction(name); fn && fn->isLocal()) {
+        destroy_ExpressionItem(self->calc, fn);
+    }
+}
+
+// Takes the new text of all lines and evaluates the lines that changed, and the ones reading
+// or defining a variable or function that they or removed lines define. What removed lines
+// defined is undefined first. Returns {[line] = {result, messages}} for the evaluated lines
+// whose result is different from before.
+int l_sheet_update(lua_State* L) {
+    LSheet* self = check_Sheet(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    std::vector<std::string> texts;
+    for (size_t i = 1; i <= lua_objlen(L, 2); i++) {
+        lua_rawgeti(L, 2, i);
+        texts.push_back(check_cppstr(L, -1));
+        lua_pop(L, 1);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->opts_ref);
+    ParseOptions opts = check_ParseOptions(L, -1);
+    lua_pop(L, 1);
+
+    // An edit replaces the lines between an unchanged prefix and an unchanged suffix.
+    // Lines without a result, after an error in an earlier update, count as changed.
+    std::vector<SheetLine>& old = *self->lines;
+    size_t n = texts.size();
+    size_t prefix = 0;
+    while (prefix < n && prefix < old.size() && old[prefix].text == texts[prefix] &&
+           old[prefix].result != LUA_NOREF) {
+        prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < n - prefix && suffix < old.size() - prefix &&
+           old[old.size() - 1 - suffix].text == texts[n - 1 - suffix] &&
+           old[old.size() - 1 - suffix].result != LUA_NOREF) {
+        suffix++;
+    }
+
+    // names whose value may be different from when the lines below last read them
+    std::unordered_set<std::string> changed;
+
+    std::vector<SheetLine> lines;
+    lines.reserve(n);
+    for (size_t i = 0; i < prefix; i++) {
+        lines.push_back(std::move(old[i]));
+    }
+    for (size_t i = prefix; i < old.size() - suffix; i++) {
+        changed.insert(old[i].names.defines.begin(), old[i].names.defines.end());
+        luaL_unref(L, LUA_REGISTRYINDEX, old[i].result);
+    }
+    for (size_t i = prefix; i < n - suffix; i++) {
+        lines.push_back({texts[i], analyze_line(texts[i], opts, self->do_assignment), LUA_NOREF});
+    }
+    for (size_t i = old.size() - suffix; i < old.size(); i++) {
+        lines.push_back(std::move(old[i]));
+    }
+    old.swap(lines);
+
+    // Lines below that define them again are evaluated as they define a changed name.
+    // Above, the last line defining one is evaluated again to restore its value.
+    std::unordered_set<size_t> redefine;
+    size_t first = prefix;
+    if (!changed.empty()) {
+        ensure_Calculator(self->owner);
+        auto lock = lock_Calculator(L, self->owner);
+        for (std::string const& name : changed) {
+            undefine(self->owner, name);
+
+            for (size_t i = prefix; i-- > 0;) {
+                auto const& defines = old[i].names.defines;
+                if (std::find(defines.begin(), defines.end(), name) != defines.end()) {
+                    redefine.insert(i);
+                    first = std::min(first, i);
+                    break;
+                }
+            }
+        }
+        self->owner->ref->epoch++;
+    }
+
+    lua_newtable(L);
+    for (size_t i = first; i < n; i++) {
+        SheetLine& line = old[i];
+        if (i < prefix ? !redefine.count(i) : i >= n - suffix && !uses_any(line.names, changed)) {
+            continue;
+        }
+
+        lua_pushcfunction(L, l_calc_eval);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->owner_ref);
+        push_cppstr(L, line.text);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->opts_ref);
+        lua_pushboolean(L, self->do_assignment);
+        lua_call(L, 4, 2);
+
+        LMathStructure* res = check_MathStructure(L, -2);
+        bool same = false;
+        if (line.result != LUA_NOREF) {
+            // the caller may have freed the old result, which then counts as changed
+            lua_rawgeti(L, LUA_REGISTRYINDEX, line.result);
+            LMathStructure* prev = (LMathStructure*)luaL_checkudata(L, -1, "QalcExpression");
+            if (prev->expr) {
+                auto lock = lock_Calculator(L, self->owner);
+                same = prev->expr->equals(*res->expr);
+            }
+            lua_pop(L, 1);
+            luaL_unref(L, LUA_REGISTRYINDEX, line.result);
+        }
+
+        if (!same) {
+            changed.insert(line.names.defines.begin(), line.names.defines.end());
+
+            lua_createtable(L, 0, 2);
+            lua_pushvalue(L, -3);
+            lua_setfield(L, -2, "result");
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -2, "messages");
+            lua_rawseti(L, -4, i + 1);
+        }
+
+        lua_pop(L, 1);
+        line.result = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    return 1;
+}
+
+// the current result of line i, nil if there is no such line
+int l_sheet_get(lua_State* L) {
+    LSheet* self = check_Sheet(L, 1);
+    size_t i = luaL_checkinteger(L, 2);
+
+    if (i < 1 || i > self->lines->size()) {
+        lua_pushnil(L);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, (*self->lines)[i - 1].result);
+    }
+    return 1;
+}
+
+int l_sheet_gc(lua_State* L) {
+    LSheet* self = check_Sheet(L, 1);
+
+    if (self->lines) {
+        for (SheetLine const& line : *self->lines) {
+            luaL_unref(L, LUA_REGISTRYINDEX, line.result);
+        }
+        delete self->lines;
+        self->lines = NULL;
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, self->opts_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, self->owner_ref);
+    return 0;
+}
+
+int l_expr_gc(lua_State* L) {
+    // views hold a reference to their owner, so it only gets here before them when closing the state
+    free_MathStructure(L, (LMathStructure*)luaL_checkudata(L, 1, "QalcExpression"));
+    return 0;
+}
+
+int l_expr_free(lua_State* L) {
+    LMathStructure* self = (LMathStructure*)luaL_checkudata(L, 1, "QalcExpression");
+    if (self->views > 0) {
+        return luaL_error(L, "expression still has %d views, e.g. from as_matrix", self->views);
+    }
+    free_MathStructure(L, self);
+    return 0;
+}
+
+// prints expr, which is self->expr or self->parsed_src, reusing the string of an earlier call with the same options
+static std::string const& print_memoized(LMathStructure* self, MathStructure const& expr, PrintOptions const& opts) {
+    std::string key = print_options_key(opts);
+    key.push_back(&expr == self->parsed_src);
+    key += std::to_string(self->precision);
+    size_t hash = std::hash<std::string>()(key);
+
+    if (!self->memo) {
+        self->memo = new PrintMemo;
+    }
+    PrintMemo& memo = *self->memo;
+    for (size_t i = 0; i < memo.used; i++) {
+        if (memo.slots[i].hash == hash && memo.slots[i].key == key) {
+            return memo.slots[i].text;
+        }
+    }
+
+    PrintMemo::Slot* slot;
+    if (memo.used < sizeof(memo.slots) / sizeof(memo.slots[0])) {
+        slot = &memo.slots[memo.used++];
+    } else {
+        slot = &memo.slots[memo.next];
+        memo.next = (memo.next + 1) % memo.used;
+    }
+    slot->hash = hash;
+    slot->key = std::move(key);
+    slot->text = expr.print(opts);
+    return slot->text;
+}
+
 int l_expr_tostring(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
-    PrintOptions opts = check_PrintOptions(L, 2);
+    auto lock = lock_Expression(L, self);
+    StatTimer timer(&self->ref->stats, STAT_PRINT);
+    PrintOptions opts = check_PrintOptions(L, 2, &self->ref->stats);
 
-    std::string s = self->expr->print(opts);
-    push_cppstr(L, s);
-    return 1 + push_messages(L, self->calc);
+    use_precision(self->ref->calc, self->precision);
+    push_cppstr(L, print_memoized(self, *self->expr, opts));
+    return 1 + push_messages(L, self->ref->calc);
 }
 
 int l_expr_tolua(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
-    PrintOptions opts = check_PrintOptions(L, 2);
+    auto lock = lock_Expression(L, self);
+    StatTimer timer(&self->ref->stats, STAT_VALUE);
+    PrintOptions opts = check_PrintOptions(L, 2, &self->ref->stats);
     MathStructure* res = self->expr;
+    use_precision(self->ref->calc, self->precision);
+
+    bool buffers = false;
+    if (lua_type(L, 2) == LUA_TTABLE) {
+        lua_getfield(L, 2, "buffer");
+        buffers = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    return push_MathStructureValue(L, *res, self->ref->calc, opts, buffers, &self->ref->stats);
+}
+
+int l_expr_flatten(lua_State* L) {
+    LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
+
+    FlatTree tree;
+    tree.add(*self->expr);
+
+    lua_createtable(L, 0, 5);
+    push_Buffer(L, tree.types.data(), tree.types.size());
+    lua_setfield(L, -2, "type");
+    push_Buffer(L, tree.children.data(), tree.children.size());
+    lua_setfield(L, -2, "children");
+    push_Buffer(L, tree.values.data(), tree.values.size());
+    lua_setfield(L, -2, "value");
+    push_Buffer(L, tree.imag.data(), tree.imag.size());
+    lua_setfield(L, -2, "imag");
+
+    lua_createtable(L, tree.strings.size(), 0);
+    for (size_t i = 0; i < tree.strings.size(); i++) {
+        push_cppstr(L, tree.strings[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "strings");
 
-    return push_MathStructureValue(L, *res, self->calc, opts);
+    return 1;
 }
 
 int l_expr_source(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
-    PrintOptions opts = check_PrintOptions(L, 2);
+    StatTimer timer(&self->ref->stats, STAT_SOURCE);
+    PrintOptions opts = check_PrintOptions(L, 2, &self->ref->stats);
+
+    auto lock = lock_Expression(L, self);
+    use_precision(self->ref->calc, self->precision);
+    if (self->lazy_src) {
+        self->parsed_src = new MathStructure(self->ref->calc->parse(self->lazy_src->expr, self->lazy_src->opts));
+        self->ref->stats.add_objects(1, 0);
+        collect_messages(self->ref->calc);
+        delete self->lazy_src;
+        self->lazy_src = NULL;
+    }
 
     if (self->parsed_src) {
-        push_cppstr(L, self->parsed_src->print(opts));
+        push_cppstr(L, print_memoized(self, *self->parsed_src, opts));
     } else {
         lua_pushnil(L);
     }
@@ -323,6 +1731,7 @@ int l_expr_source(lua_State* L) {
 
 int l_expr_type(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
 
     push_cppstr(L, self->expr->isMatrix() ? "matrix" : type_names[self->expr->type()]);
     return 1;
@@ -330,6 +1739,7 @@ int l_expr_type(lua_State* L) {
 
 int l_expr_is_approximate(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
 
     lua_pushboolean(L, self->expr->isApproximate());
 
@@ -338,6 +1748,8 @@ int l_expr_is_approximate(lua_State* L) {
 
 int l_expr_as_matrix(lua_State* L) {
     LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
+    StatTimer timer(&self->ref->stats, STAT_AS_MATRIX);
     if (!self->expr->isMatrix()) {
         lua_pushnil(L);
         return 1;
@@ -345,18 +1757,14 @@ int l_expr_as_matrix(lua_State* L) {
 
     int rows = self->expr->rows();
     int cols = self->expr->columns();
+    self->ref->stats.add_objects(0, rows + 1);
     lua_createtable(L, rows, 0);
     for (int i = 0; i < rows; i++) {
         lua_createtable(L, cols, 0);
         for (int j = 0; j < cols; j++) {
-            auto em = self->expr->getElement(i + 1, j + 1);
+            MathStructure* em = self->expr->getElement(i + 1, j + 1);
             if (em) {
-                LMathStructure* res = (LMathStructure*)lua_newuserdata(L, sizeof(LMathStructure));
-                luaL_getmetatable(L, "QalcExpression");
-                lua_setmetatable(L, -2);
-
-                res->calc = self->calc;
-                res->expr = new MathStructure(*em);
+                push_ExpressionView(L, 1, em);
                 lua_rawseti(L, -2, j + 1);
             }
         }
@@ -366,15 +1774,102 @@ int l_expr_as_matrix(lua_State* L) {
     return 1;
 }
 
+int l_expr_rows(lua_State* L) {
+    LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
+    if (!self->expr->isMatrix()) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, self->expr->rows());
+    }
+    return 1;
+}
+
+int l_expr_cols(lua_State* L) {
+    LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
+    if (!self->expr->isMatrix()) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, self->expr->columns());
+    }
+    return 1;
+}
+
+int l_expr_at(lua_State* L) {
+    LMathStructure* self = check_MathStructure(L, 1);
+    auto lock = lock_Expression(L, self);
+    int row = luaL_checkinteger(L, 2);
+    int col = luaL_checkinteger(L, 3);
+
+    MathStructure* em = NULL;
+    if (self->expr->isMatrix() && row > 0 && col > 0) {
+        em = self->expr->getElement(row, col);
+    }
+
+    if (em) {
+        push_ExpressionView(L, 1, em);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
 int luaopen_qalculate_qalc(lua_State* L) {
+    register_Buffer(L);
+    register_Options(L);
+
     luaL_newmetatable(L, "QalcCalculator");
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
 
-    const luaL_Reg calculator_mt[] = {{"__gc", l_calc_gc},    {"eval", l_calc_eval},   {"get", l_calc_getvar},
-                                      {"set", l_calc_setvar}, {"reset", l_calc_reset}, {NULL}};
+    const luaL_Reg calculator_mt[] = {
+        {"__gc", l_calc_gc},
+        {"eval", l_calc_eval},
+        {"eval_async", l_calc_eval_async},
+        {"eval_batch", l_calc_eval_batch},
+        {"async_fd", l_calc_async_fd},
+        {"dispatch", l_calc_dispatch},
+        {"get", l_calc_getvar},
+        {"set", l_calc_setvar},
+        {"reset", l_calc_reset},
+        {"cache_stats", l_calc_cache_stats},
+        {"set_cache_size", l_calc_set_cache_size},
+        {"set_disk_cache", l_calc_set_disk_cache},
+        {"set_options", l_calc_set_options},
+        {"stats", l_calc_stats},
+        {"reset_stats", l_calc_reset_stats},
+        {"compile", l_calc_compile},
+        {"sheet", l_calc_sheet},
+        {NULL},
+    };
     luaL_register(L, NULL, calculator_mt);
 
+    luaL_newmetatable(L, "QalcCompiled");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    const luaL_Reg compiled_mt[] = {
+        {"__gc", l_compiled_gc},
+        {"__call", l_compiled_call},
+        {"eval", l_compiled_eval},
+        {"is_fast", l_compiled_is_fast},
+        {NULL},
+    };
+    luaL_register(L, NULL, compiled_mt);
+
+    luaL_newmetatable(L, "QalcSheet");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    const luaL_Reg sheet_mt[] = {
+        {"__gc", l_sheet_gc},
+        {"update", l_sheet_update},
+        {"get", l_sheet_get},
+        {NULL},
+    };
+    luaL_register(L, NULL, sheet_mt);
+
     luaL_newmetatable(L, "QalcExpression");
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
@@ -388,6 +1883,11 @@ int luaopen_qalculate_qalc(lua_State* L) {
         {"source", l_expr_source},
         {"is_approximate", l_expr_is_approximate},
         {"as_matrix", l_expr_as_matrix},
+        {"flatten", l_expr_flatten},
+        {"rows", l_expr_rows},
+        {"cols", l_expr_cols},
+        {"at", l_expr_at},
+        {"free", l_expr_free},
         {NULL},
     };
     luaL_register(L, NULL, expression_mt);
@@ -395,10 +1895,20 @@ int luaopen_qalculate_qalc(lua_State* L) {
     lua_newtable(L);
     const luaL_Reg library[] = {
         {"new", l_calc_new},
+        {"print_options", l_print_options},
+        {"parse_options", l_parse_options},
         {NULL, NULL},
     };
     luaL_register(L, NULL, library);
 
+    // type ids used by expr:flatten()
+    lua_createtable(L, 0, sizeof(type_names) / sizeof(type_names[0]));
+    for (size_t i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++) {
+        lua_pushinteger(L, i);
+        lua_setfield(L, -2, type_names[i].c_str());
+    }
+    lua_setfield(L, -2, "types");
+
     return 1;
 }
 }
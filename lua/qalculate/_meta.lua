@@ -13,10 +13,35 @@ error("Cannot require a meta file")
 ---@field excessive_parenthesis boolean?
 ---@field interval_display "adaptive"| "significant"| "interval"| "plusminus"| "midpoint"| "lower"| "upper"| "concise"| "relative"?
 ---@field unicode "on"|"off"|"no-unit"?
+--- Only used by value(): return vectors of real numbers as QalcBuffers
+---@field buffer boolean?
 
----@class QalcParseOptions
+---@class QalcParseOptions: QalcEvaluationOptions
 ---@field base QalcBase?
 ---@field mode "default"|"rpn"
+--- What eval keeps for source(): the parsed input (default), the input text to parse
+--- again on the first call to source(), or nothing, making source() return nil
+---@field source "keep"|"lazy"|"none"?
+--- eval and eval_batch only: stop calculating after this many milliseconds, returning an aborted
+--- result. eval_batch applies it to each expression.
+---@field timeout_ms integer?
+--- eval and eval_batch only: on timeout, retry in approximate mode within the remaining time
+---@field fallback "none"|"approximate"?
+
+--- Options checked once by qalc.print_options/qalc.parse_options, cheaper to pass
+--- on every call than a table. They can't be changed after construction.
+--- QalcPrintOptionsObject doesn't support the buffer field of value().
+---@class QalcPrintOptionsObject: userdata
+---@class QalcParseOptionsObject: userdata
+
+--- How eval calculates, set per calculator with set_options or per call with the parse options.
+--- "approximate" with a low precision is much cheaper for callers that only want a float.
+---@class QalcEvaluationOptions
+---@field approximation "exact"|"try_exact"|"approximate"?
+---@field precision integer? significant digits, also used when printing the results
+---@field structuring "none"|"simplify"|"factorize"?
+---@field interval_calculation "none"|"variance"|"interval"|"simple"?
+---@field auto_conversion "none"|"optimal_si"|"base"|"optimal"?
 
 ---@class QalcPlotMeta
 ---@field step number?
@@ -24,31 +49,163 @@ error("Cannot require a meta file")
 ---@field type string?
 ---@field range {[1]: number, [2]: number}?
 ---@field extra string[]
+---@field series integer? number of expressions when plotting a vector of them, y then holds one array per expression
+---@field chunk integer? 1-based index of the points when streaming with chunk=
+---@field done boolean? set on the last call when streaming, without points
+
+--- Returning false stops sampling when streaming with chunk=. Using the plotting calculator, its
+--- results or another handle of the shared one from the handler raises an error; an error raised
+--- by the handler stops the plot and becomes a message of the eval.
+---@alias QalcPlotHandler fun(x: number[]|QalcBuffer|nil, y: number[]|QalcBuffer|(number[]|QalcBuffer)[]|nil, opts: QalcPlotMeta): boolean?
 
----@alias QalcPlotHandler fun(x: number[], y: number[], opts: QalcPlotMeta)
+--- A contiguous array of doubles, indexable like a list.
+--- ptr() points at the first element, e.g. for ffi.cast("double*", buf:ptr()),
+--- and is only valid while the buffer is referenced
+---@class QalcBuffer
+---@operator len: integer
+---@field [integer] number
+---@field ptr fun(self: QalcBuffer): lightuserdata
+---@field totable fun(self: QalcBuffer): number[]
+
+--- An expression tree as columns, one entry per node in preorder.
+--- A node is followed by its children[i] child nodes.
+---@class QalcFlatTree
+---@field type QalcBuffer node type ids, see Qalculate.types
+---@field children QalcBuffer
+--- Numbers: the real part. Comparisons: the comparison type.
+--- Units, variables, functions and symbols: the index of their name in strings.
+--- NaN for everything else.
+---@field value QalcBuffer
+---@field imag QalcBuffer imaginary part of numbers, else 0
+---@field strings string[]
+
+---@class QalcCalculatorOptions
+---@field exchange_rates boolean? load currency exchange rates, defaults to true
+--- When to load the definitions of units, functions and variables:
+--- when creating the calculator, on first use, or on a thread that the first use waits for.
+--- "background" is only used while no other calculator exists, otherwise it acts like "lazy".
+---@field definitions "eager"|"lazy"|"background"?
+--- Use the definitions of one calculator shared by the whole process. Variables set through
+--- this handle are only visible to it; assignments that overwrite a predefined variable are not.
+---@field shared boolean?
 
 ---@class Qalculate
----@field new fun(plot: QalcPlotHandler?): QalcCalculator
+---@field new fun(plot: QalcPlotHandler?, opts: QalcCalculatorOptions?): QalcCalculator
+---@field print_options fun(opts: QalcPrintOptions): QalcPrintOptionsObject
+---@field parse_options fun(opts: QalcParseOptions): QalcParseOptionsObject
+--- eval_batch on the default calculator
+---@field eval_batch fun(exprs: string[], opts: (QalcParseOptions|QalcParseOptionsObject)?): QalcExpression[], QalcMessages[]
+--- Node type ids of QalcFlatTree.type by name, e.g. types.addition
+---@field types table<string, integer>
 
 ---@alias QalcMessages {[1]: string, [2]: vim.log.levels}[]
 
+---@class QalcCacheStats
+---@field hits integer
+---@field misses integer
+---@field size integer
+---@field capacity integer
+---@field disk QalcDiskCacheStats? only with set_disk_cache
+
+---@class QalcDiskCacheStats
+---@field hits integer
+---@field misses integer
+---@field size integer entries
+---@field bytes integer
+
+---@class QalcDiskCacheOptions
+---@field dir string? defaults to $XDG_CACHE_HOME/qalculate.nvim
+---@field max_size integer? bytes, the least recently used results are removed beyond it, 64 MiB by default
+---@field min_ms integer? only results that took at least this long are stored, 100 by default
+
+---@class QalcPhaseStats
+---@field calls integer
+---@field total_ms number
+---@field max_ms number
+
+--- Recorded per calculator, all handles of the shared calculator record into the same stats
+---@class QalcStats
+---@field enabled boolean
+---@field math_structures integer MathStructures allocated by the bindings
+---@field lua_objects integer tables, userdata and strings created for results
+---@field options QalcPhaseStats decoding option tables
+---@field eval QalcPhaseStats
+---@field calculate QalcPhaseStats the calculation in eval, including parsing
+---@field print QalcPhaseStats
+---@field value QalcPhaseStats
+---@field source QalcPhaseStats
+---@field as_matrix QalcPhaseStats
+---@field plot_callback QalcPhaseStats
+
 ---@class QalcCalculator
----@field eval fun(self: QalcCalculator, expr: string, parse_opts: QalcParseOptions?, allow_assingment: boolean?): QalcExpression, QalcMessages?
----@field plot fun(self: QalcCalculator, expr: string, min: QalcInput, max: QalcInput, step: QalcInput, parse_opts: QalcParseOptions?): number[]
+---@field eval fun(self: QalcCalculator, expr: string, parse_opts: (QalcParseOptions|QalcParseOptionsObject)?, allow_assingment: boolean?): QalcExpression, QalcMessages?
+--- Evaluates on a worker thread, a newer call aborts the previous one which then never calls back
+---@field eval_async fun(self: QalcCalculator, expr: string, parse_opts: (QalcParseOptions|QalcParseOptionsObject)?, callback: fun(result: QalcExpression, messages: QalcMessages?))
+--- Evaluates the expressions one after another with a single call, returning the results
+--- and a (possibly empty) list of messages per expression in input order. source, timeout_ms
+--- and fallback apply as for eval. plot() is not passed to the handler.
+---@field eval_batch fun(self: QalcCalculator, exprs: string[], opts: (QalcParseOptions|QalcParseOptionsObject)?): QalcExpression[], QalcMessages[]
+--- Readable whenever eval_async results are ready, only needed without the lua wrapper
+---@field async_fd fun(self: QalcCalculator): integer
+--- Runs the callbacks of finished eval_async jobs, returns the number of jobs still pending
+---@field dispatch fun(self: QalcCalculator): integer
+---@field plot fun(self: QalcCalculator, expr: string, min: QalcInput, max: QalcInput, step: QalcInput, parse_opts: (QalcParseOptions|QalcParseOptionsObject)?): number[]
 ---@field reset fun(self: QalcCalculator, variables: boolean)
+--- Results of eval are cached until a variable changes, 64 entries by default, 0 disables the cache
+---@field set_cache_size fun(self: QalcCalculator, size: integer)
+---@field cache_stats fun(self: QalcCalculator): QalcCacheStats
+--- Keeps results of eval that took long on disk across sessions, false or nil turns it off again
+---@field set_disk_cache fun(self: QalcCalculator, opts: QalcDiskCacheOptions|boolean|nil)
+--- Changes the given evaluation options for all later evals, compile and eval_async
+---@field set_options fun(self: QalcCalculator, opts: QalcEvaluationOptions)
+---@field stats fun(self: QalcCalculator): QalcStats
+--- Clears the stats, and enables or disables recording them if enable is given. Disabled by default.
+---@field reset_stats fun(self: QalcCalculator, enable: boolean?)
+--- Parses expr once, names in args become the parameters of the returned function.
+--- Evaluation options in parse_opts and the calculator's current ones apply to every call.
+---@field compile fun(self: QalcCalculator, expr: string, args: string[], parse_opts: (QalcParseOptions|QalcParseOptionsObject)?): QalcCompiled, QalcMessages?
+--- A sheet of lines evaluated like eval(line, parse_opts, allow_assignment)
+---@field sheet fun(self: QalcCalculator, parse_opts: (QalcParseOptions|QalcParseOptionsObject)?, allow_assignment: boolean?): QalcSheet
 ---@field get fun(self: QalcCalculator, name: string): QalcExpression
 ---@field set fun(self: QalcCalculator, name: string, value: QalcInput): boolean
 
+--- Calling it returns the result as a number, approximated, NaN if the result is not a real number
+---@class QalcCompiled
+---@operator call(...: number): number
+--- The result with the options given to compile, exact by default
+---@field eval fun(self: QalcCompiled, ...: number): QalcExpression, QalcMessages?
+--- Whether calls are evaluated in double precision instead of by libqalculate. The first 8 calls
+--- are also evaluated approximately by libqalculate, a disagreement turns the fast path off for good.
+---@field is_fast fun(self: QalcCompiled): boolean
+
+--- Lines evaluated in order that only re-evaluates what an edit can affect
+---@class QalcSheet
+--- Takes the text of all lines, evaluates the changed lines and the lines reading or defining a
+--- variable or function that an evaluated or removed line defines. What removed lines defined is
+--- undefined first. Returns the evaluated lines whose result changed.
+---@field update fun(self: QalcSheet, lines: string[]): table<integer, {result: QalcExpression, messages: QalcMessages?}>
+--- The current result of line i
+---@field get fun(self: QalcSheet, i: integer): QalcExpression?
+
 ---@class QalcExpression
----@field print fun(self: QalcExpression, opts: QalcPrintOptions?): string, QalcMessages?
----@field value fun(self: QalcExpression, opts: QalcPrintOptions?): QalcValue
+---@field print fun(self: QalcExpression, opts: (QalcPrintOptions|QalcPrintOptionsObject)?): string, QalcMessages?
+---@field value fun(self: QalcExpression, opts: (QalcPrintOptions|QalcPrintOptionsObject)?): QalcValue
 ---@field type fun(self: QalcExpression): QalcType
----@field source fun(self: QalcExpression, opts: QalcPrintOptions?): string?
+---@field source fun(self: QalcExpression, opts: (QalcPrintOptions|QalcPrintOptionsObject)?): string?
+--- Releases the expression right away instead of on garbage collection, it can't be used afterwards.
+--- Fails while views returned by as_matrix() or at() are still alive.
+---@field free fun(self: QalcExpression)
 ---@field is_approximate fun(self: QalcExpression): boolean
+---@field flatten fun(self: QalcExpression): QalcFlatTree
+--- The elements are views into this expression and keep it alive
 ---@field as_matrix fun(self: QalcExpression): QalcExpression[][]?
+---@field rows fun(self: QalcExpression): integer? nil if not a matrix
+---@field cols fun(self: QalcExpression): integer? nil if not a matrix
+--- A view of the element in row i, column j, nil if out of range or not a matrix
+---@field at fun(self: QalcExpression, i: integer, j: integer): QalcExpression?
 
 --- Regular Number | Vector | Matrix | Expression
----@alias QalcValue number|number[]|number[][]|{[1]: QalcType, [integer]: QalcValue}
+---@alias QalcValue number|number[]|number[][]|QalcBuffer|QalcBuffer[]|{[1]: QalcType, [integer]: QalcValue}
 
 ---@alias QalcInput string|number|QalcExpression
 
@@ -4,8 +4,60 @@ package.cpath = package.cpath .. ";" .. soname
 
 ---@type Qalculate
 local qalc = require("qalculate.qalc")
+local uv = vim.uv or vim.loop
 
-return {
+-- eval_async results arrive through a pipe, watch it on the main loop
+-- while jobs are in flight and hand them out with dispatch()
+local calculator_mt = debug.getregistry().QalcCalculator
+local eval_async = calculator_mt.eval_async
+local watchers = {}
+
+calculator_mt.eval_async = function(self, expr, opts, callback)
+    eval_async(self, expr, opts, callback)
+    if watchers[self] then
+        return
+    end
+
+    local poll = uv.new_poll(self:async_fd())
+    watchers[self] = poll
+
+    local function on_readable()
+        poll:stop()
+        vim.schedule(function()
+            -- a callback that raises must not leave the calculator without a watcher
+            local ok, pending = pcall(self.dispatch, self)
+            if not ok or pending > 0 then
+                poll:start("r", on_readable)
+            else
+                poll:close()
+                watchers[self] = nil
+            end
+            if not ok then
+                error(pending, 0)
+            end
+        end)
+    end
+    poll:start("r", on_readable)
+end
+
+-- the default calculator is only created once somebody asks for it
+local M = setmetatable({
     new = qalc.new,
-    default = qalc.new(),
-}
+    print_options = qalc.print_options,
+    parse_options = qalc.parse_options,
+    types = qalc.types,
+}, {
+    __index = function(self, key)
+        if key == "default" then
+            local default = qalc.new(nil, { definitions = "lazy" })
+            rawset(self, "default", default)
+            return default
+        end
+    end,
+})
+
+function M.eval_batch(exprs, opts)
+    return M.default:eval_batch(exprs, opts)
+end
+
+return M
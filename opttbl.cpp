@@ -1,5 +1,8 @@
 #include <lua5.1/lua.hpp>
 #include <libqalculate/includes.h>
+#include <new>
+
+#include "opttbl.hpp"
 
 static void opt_getbase(lua_State* L, int index, int* dest) {
     lua_getfield(L, index, "base");
@@ -17,35 +20,33 @@ static void opt_getbase(lua_State* L, int index, int* dest) {
             *dest = BASE_TIME;
         }
     }
+    lua_pop(L, 1);
 }
 
 static inline void opt_getboolean(lua_State* L, int index, bool* dest, char const* field) {
     lua_getfield(L, index, field);
-    if (lua_type(L, -1) == LUA_TNIL) {
-        lua_remove(L, -1);
-    } else {
+    if (lua_type(L, -1) != LUA_TNIL) {
         *dest = lua_toboolean(L, -1);
     }
+    lua_pop(L, 1);
 }
 
 static inline void opt_getinteger(lua_State* L, int index, int* dest, char const* field) {
     lua_getfield(L, index, field);
-    if (lua_type(L, -1) == LUA_TNIL) {
-        lua_remove(L, -1);
-    } else {
+    if (lua_type(L, -1) != LUA_TNIL) {
         *dest = lua_tointeger(L, -1);
     }
+    lua_pop(L, 1);
 }
 
 static inline void opt_getstring(lua_State* L, int index, std::string* dest, char const* field) {
     lua_getfield(L, index, field);
-    if (lua_type(L, -1) != LUA_TSTRING) {
-        lua_remove(L, -1);
-    } else {
+    if (lua_type(L, -1) == LUA_TSTRING) {
         size_t len;
         const char* buf = lua_tolstring(L, -1, &len);
         *dest = std::string(buf, len);
     }
+    lua_pop(L, 1);
 }
 
 struct EnumPair {
@@ -53,21 +54,56 @@ struct EnumPair {
     int value;
 };
 
-static inline void opt_getenum(lua_State* L, int index, int* dest, char const* field, EnumPair const keys[]) {
+// with strict set, unknown values are an error instead of being ignored
+static inline void opt_getenum(lua_State* L, int index, int* dest, char const* field, EnumPair const keys[],
+                               bool strict) {
     lua_getfield(L, index, field);
-    if (lua_type(L, -1) != LUA_TSTRING) {
-        lua_remove(L, -1);
-    } else {
+    if (lua_type(L, -1) == LUA_TSTRING) {
         const char* key = lua_tostring(L, -1);
 
         int i = 0;
-        while (keys[i].key) {
-            if (strcmp(keys[i].key, key) == 0) {
-                *dest = keys[i].value;
-            }
+        while (keys[i].key && strcmp(keys[i].key, key) != 0) {
             i++;
         }
+        if (keys[i].key) {
+            *dest = keys[i].value;
+        } else if (strict) {
+            luaL_error(L, "invalid value '%s' for option '%s'", key, field);
+        }
     }
+    lua_pop(L, 1);
+}
+
+// errors on fields of the table at index that aren't in fields
+static void opt_checkfields(lua_State* L, int index, const char* const fields[]) {
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_error(L, "option names must be strings");
+        }
+
+        const char* name = lua_tostring(L, -1);
+        int i = 0;
+        while (fields[i] && strcmp(fields[i], name) != 0) {
+            i++;
+        }
+        if (!fields[i]) {
+            luaL_error(L, "unknown option '%s'", name);
+        }
+    }
+}
+
+// returns the userdata at index if its metatable is tname, else NULL
+static void* opt_testudata(lua_State* L, int index, const char* tname) {
+    void* p = lua_touserdata(L, index);
+    if (!p || !lua_getmetatable(L, index)) {
+        return NULL;
+    }
+    luaL_getmetatable(L, tname);
+    bool matches = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return matches ? p : NULL;
 }
 
 const EnumPair interval_display_options[] = {
@@ -89,11 +125,21 @@ const EnumPair unicode_sign_options[] = {
     {NULL},
 };
 
-PrintOptions check_PrintOptions(lua_State* L, int index) {
+const char* const print_option_fields[] = {
+    "base",
+    "min_decimals",
+    "max_decimals",
+    "abbreviate_names",
+    "negative_exponents",
+    "spacious",
+    "excessive_parenthesis",
+    "unicode",
+    "interval_display",
+    NULL,
+};
+
+static PrintOptions read_PrintOptions(lua_State* L, int index, bool strict) {
     PrintOptions ret = default_print_options;
-    if (lua_type(L, index) != LUA_TTABLE) {
-        return ret;
-    }
 
     opt_getbase(L, index, &ret.base);
     opt_getinteger(L, index, &ret.min_decimals, "min_decimals");
@@ -104,11 +150,23 @@ PrintOptions check_PrintOptions(lua_State* L, int index) {
     opt_getboolean(L, index, &ret.spacious, "spacious");
     opt_getboolean(L, index, &ret.excessive_parenthesis, "excessive_parenthesis");
 
-    opt_getenum(L, index, &ret.use_unicode_signs, "unicode", unicode_sign_options);
-    opt_getenum(L, index, (int*)&ret.interval_display, "interval_display", interval_display_options);
+    opt_getenum(L, index, &ret.use_unicode_signs, "unicode", unicode_sign_options, strict);
+    opt_getenum(L, index, (int*)&ret.interval_display, "interval_display", interval_display_options, strict);
 
     return ret;
-};
+}
+
+PrintOptions check_PrintOptions(lua_State* L, int index) {
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        if (void* p = opt_testudata(L, index, "QalcPrintOptions")) {
+            return *(PrintOptions*)p;
+        }
+    }
+    if (lua_type(L, index) != LUA_TTABLE) {
+        return default_print_options;
+    }
+    return read_PrintOptions(L, index, false);
+}
 
 EnumPair parsing_mode_options[] = {
     {"default", PARSING_MODE_ADAPTIVE},
@@ -116,15 +174,261 @@ EnumPair parsing_mode_options[] = {
     {NULL},
 };
 
-ParseOptions check_ParseOptions(lua_State* L, int index) {
-    ParseOptions ret = default_parse_options;
+const EnumPair source_mode_options[] = {
+    {"keep", SOURCE_KEEP},
+    {"lazy", SOURCE_LAZY},
+    {"none", SOURCE_NONE},
+    {NULL},
+};
+
+const EnumPair fallback_options[] = {
+    {"none", FALLBACK_NONE},
+    {"approximate", FALLBACK_APPROXIMATE},
+    {NULL},
+};
+
+const EnumPair approximation_options[] = {
+    {"exact", APPROXIMATION_EXACT},
+    {"try_exact", APPROXIMATION_TRY_EXACT},
+    {"approximate", APPROXIMATION_APPROXIMATE},
+    {NULL},
+};
+
+const EnumPair structuring_options[] = {
+    {"none", STRUCTURING_NONE},
+    {"simplify", STRUCTURING_SIMPLIFY},
+    {"factorize", STRUCTURING_FACTORIZE},
+    {NULL},
+};
+
+const EnumPair interval_calculation_options[] = {
+    {"none", INTERVAL_CALCULATION_NONE},
+    {"variance", INTERVAL_CALCULATION_VARIANCE_FORMULA},
+    {"interval", INTERVAL_CALCULATION_INTERVAL_ARITHMETIC},
+    {"simple", INTERVAL_CALCULATION_SIMPLE_INTERVAL_ARITHMETIC},
+    {NULL},
+};
+
+const EnumPair auto_post_conversion_options[] = {
+    {"none", POST_CONVERSION_NONE},
+    {"optimal_si", POST_CONVERSION_OPTIMAL_SI},
+    {"base", POST_CONVERSION_BASE},
+    {"optimal", POST_CONVERSION_OPTIMAL},
+    {NULL},
+};
+
+#define EVALUATION_OPTION_FIELDS "approximation", "precision", "structuring", "interval_calculation", "auto_conversion"
+
+const char* const evaluation_option_fields[] = {
+    EVALUATION_OPTION_FIELDS,
+    NULL,
+};
+
+const char* const parse_option_fields[] = {
+    "base",
+    "mode",
+    // CallOptions
+    "source",
+    "timeout_ms",
+    "fallback",
+    EVALUATION_OPTION_FIELDS,
+    NULL,
+};
+
+// the evaluation options set by a table, -1 for the ones it leaves alone
+struct EvaluationOverrides {
+    int approximation = -1;
+    int precision = -1;
+    int structuring = -1;
+    int interval_calculation = -1;
+    int auto_post_conversion = -1;
+};
+
+// QalcParseOptions
+struct LParseOptions {
+    ParseOptions opts;
+    CallOptions call;
+    EvaluationOverrides eval;
+};
+
+static EvaluationOverrides read_EvaluationOverrides(lua_State* L, int index, bool strict) {
+    EvaluationOverrides ret;
+    opt_getenum(L, index, &ret.approximation, "approximation", approximation_options, strict);
+    opt_getinteger(L, index, &ret.precision, "precision");
+    opt_getenum(L, index, &ret.structuring, "structuring", structuring_options, strict);
+    opt_getenum(L, index, &ret.interval_calculation, "interval_calculation", interval_calculation_options, strict);
+    opt_getenum(L, index, &ret.auto_post_conversion, "auto_conversion", auto_post_conversion_options, strict);
+
+    if (strict && ret.precision != -1 && ret.precision < 1) {
+        luaL_error(L, "precision must be positive");
+    }
+    return ret;
+}
+
+static EvaluationOptions apply_EvaluationOverrides(EvaluationOverrides const& o, EvaluationOptions eo, int* precision) {
+    if (o.approximation != -1) {
+        eo.approximation = (ApproximationMode)o.approximation;
+    }
+    if (o.precision > 0) {
+        *precision = o.precision;
+    }
+    if (o.structuring != -1) {
+        eo.structuring = (StructuringMode)o.structuring;
+    }
+    if (o.interval_calculation != -1) {
+        eo.interval_calculation = (IntervalCalculation)o.interval_calculation;
+    }
+    if (o.auto_post_conversion != -1) {
+        eo.auto_post_conversion = (AutoPostConversion)o.auto_post_conversion;
+    }
+    return eo;
+}
+
+EvaluationOptions check_EvaluationOptions(lua_State* L, int index, EvaluationOptions const& base, int* precision) {
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        if (void* p = opt_testudata(L, index, "QalcParseOptions")) {
+            return apply_EvaluationOverrides(((LParseOptions*)p)->eval, base, precision);
+        }
+    }
     if (lua_type(L, index) != LUA_TTABLE) {
-        return ret;
+        return base;
     }
+    return apply_EvaluationOverrides(read_EvaluationOverrides(L, index, false), base, precision);
+}
+
+EvaluationOptions set_EvaluationOptions(lua_State* L, int index, EvaluationOptions const& base, int* precision) {
+    luaL_checktype(L, index, LUA_TTABLE);
+    opt_checkfields(L, index, evaluation_option_fields);
+    return apply_EvaluationOverrides(read_EvaluationOverrides(L, index, true), base, precision);
+}
+
+static ParseOptions read_ParseOptions(lua_State* L, int index, bool strict) {
+    ParseOptions ret = default_parse_options;
 
     opt_getbase(L, index, &ret.base);
 
-    opt_getenum(L, index, (int*)&ret.parsing_mode, "mode", parsing_mode_options);
+    opt_getenum(L, index, (int*)&ret.parsing_mode, "mode", parsing_mode_options, strict);
 
     return ret;
 }
+
+ParseOptions check_ParseOptions(lua_State* L, int index) {
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        if (void* p = opt_testudata(L, index, "QalcParseOptions")) {
+            return ((LParseOptions*)p)->opts;
+        }
+    }
+    if (lua_type(L, index) != LUA_TTABLE) {
+        return default_parse_options;
+    }
+    return read_ParseOptions(L, index, false);
+}
+
+const CallOptions default_call_options = {SOURCE_KEEP, 0, FALLBACK_NONE};
+
+static CallOptions read_CallOptions(lua_State* L, int index, bool strict) {
+    CallOptions ret = default_call_options;
+    int source = ret.source;
+    int fallback = ret.fallback;
+
+    opt_getenum(L, index, &source, "source", source_mode_options, strict);
+    opt_getinteger(L, index, &ret.timeout_ms, "timeout_ms");
+    opt_getenum(L, index, &fallback, "fallback", fallback_options, strict);
+
+    ret.source = (SourceMode)source;
+    ret.fallback = (FallbackMode)fallback;
+    return ret;
+}
+
+CallOptions check_CallOptions(lua_State* L, int index) {
+    if (lua_type(L, index) == LUA_TUSERDATA) {
+        if (void* p = opt_testudata(L, index, "QalcParseOptions")) {
+            return ((LParseOptions*)p)->call;
+        }
+    }
+    if (lua_type(L, index) != LUA_TTABLE) {
+        return default_call_options;
+    }
+    return read_CallOptions(L, index, false);
+}
+
+int l_print_options(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    opt_checkfields(L, 1, print_option_fields);
+    PrintOptions opts = read_PrintOptions(L, 1, true);
+
+    void* p = lua_newuserdata(L, sizeof(PrintOptions));
+    new (p) PrintOptions(opts);
+    luaL_getmetatable(L, "QalcPrintOptions");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+int l_parse_options(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    opt_checkfields(L, 1, parse_option_fields);
+    ParseOptions opts = read_ParseOptions(L, 1, true);
+    CallOptions call = read_CallOptions(L, 1, true);
+    EvaluationOverrides eval = read_EvaluationOverrides(L, 1, true);
+
+    LParseOptions* p = (LParseOptions*)lua_newuserdata(L, sizeof(LParseOptions));
+    new (&p->opts) ParseOptions(opts);
+    p->call = call;
+    p->eval = eval;
+    luaL_getmetatable(L, "QalcParseOptions");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int l_print_options_gc(lua_State* L) {
+    ((PrintOptions*)lua_touserdata(L, 1))->~PrintOptions();
+    return 0;
+}
+
+static int l_parse_options_gc(lua_State* L) {
+    ((LParseOptions*)lua_touserdata(L, 1))->opts.~ParseOptions();
+    return 0;
+}
+
+void register_Options(lua_State* L) {
+    // no __index, the options can't be read or changed after construction
+    luaL_newmetatable(L, "QalcPrintOptions");
+    lua_pushcfunction(L, l_print_options_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, "QalcParseOptions");
+    lua_pushcfunction(L, l_parse_options_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
+template <typename T> static inline void key_append(std::string& key, T value) {
+    key.append((const char*)&value, sizeof(value));
+}
+
+std::string print_options_key(PrintOptions const& po) {
+    std::string key;
+    key_append(key, po.base);
+    key_append(key, po.min_decimals);
+    key_append(key, po.max_decimals);
+    key_append(key, po.abbreviate_names);
+    key_append(key, po.negative_exponents);
+    key_append(key, po.spacious);
+    key_append(key, po.excessive_parenthesis);
+    key_append(key, po.use_unicode_signs);
+    key_append(key, po.interval_display);
+    return key;
+}
+
+std::string options_key(EvaluationOptions const& eo, int precision) {
+    std::string key;
+    key_append(key, eo.parse_options.base);
+    key_append(key, eo.parse_options.parsing_mode);
+    key_append(key, eo.approximation);
+    key_append(key, eo.structuring);
+    key_append(key, eo.interval_calculation);
+    key_append(key, eo.auto_post_conversion);
+    key_append(key, precision);
+    return key;
+}
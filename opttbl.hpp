@@ -1,5 +1,45 @@
 #include <libqalculate/includes.h>
 #include <lua5.1/lua.hpp>
 
+// accept either an options table or the userdata made by the constructors below
 ParseOptions check_ParseOptions(lua_State* L, int index);
 PrintOptions check_PrintOptions(lua_State* L, int index);
+
+// what eval keeps of the parsed input for expr:source()
+enum SourceMode {
+    SOURCE_KEEP, // the parsed MathStructure
+    SOURCE_LAZY, // the input text, parsed again when needed
+    SOURCE_NONE,
+};
+
+// what eval does when it runs out of time
+enum FallbackMode {
+    FALLBACK_NONE,
+    FALLBACK_APPROXIMATE, // retry in approximate mode within the remaining time
+};
+
+// options of a single eval that are none of libqalculate's, passed along with the parse options
+struct CallOptions {
+    SourceMode source;
+    int timeout_ms; // 0 for no limit
+    FallbackMode fallback;
+};
+CallOptions check_CallOptions(lua_State* L, int index);
+
+// qalc.print_options/qalc.parse_options, validate a table once into an immutable
+// QalcPrintOptions/QalcParseOptions userdata
+int l_print_options(lua_State* L);
+int l_parse_options(lua_State* L);
+
+// creates the QalcPrintOptions and QalcParseOptions metatables
+void register_Options(lua_State* L);
+
+// Returns base with the evaluation options of the options at index applied, a table or QalcParseOptions.
+// libqalculate keeps the precision in the Calculator, so it is returned through precision instead.
+EvaluationOptions check_EvaluationOptions(lua_State* L, int index, EvaluationOptions const& base, int* precision);
+// the same for the table at index, erroring on anything but valid evaluation options
+EvaluationOptions set_EvaluationOptions(lua_State* L, int index, EvaluationOptions const& base, int* precision);
+
+// identify the options check_*Options can change, for use in cache keys
+std::string options_key(EvaluationOptions const& eo, int precision);
+std::string print_options_key(PrintOptions const& po);
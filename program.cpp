@@ -0,0 +1,461 @@
+#include "program.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <libqalculate/ExpressionItem.h>
+#include <libqalculate/Function.h>
+#include <libqalculate/Number.h>
+#include <libqalculate/Variable.h>
+#include <limits>
+
+// deeper expressions are evaluated exactly
+#define PROGRAM_MAX_STACK 64
+#define PROGRAM_MAX_DEPTH 256
+// points per column in run_batch
+#define PROGRAM_BLOCK 256
+// repeated subexpressions beyond these are evaluated every time
+#define PROGRAM_MAX_TEMPS 64
+#define PROGRAM_MAX_SHARED 1024
+
+struct UnaryFunction {
+    const char* name;
+    double (*fn)(double);
+    bool angle;
+};
+
+static const UnaryFunction unary_functions[] = {
+    {"sin", [](double v) { return std::sin(v); }, true},
+    {"cos", [](double v) { return std::cos(v); }, true},
+    {"tan", [](double v) { return std::tan(v); }, true},
+    {"asin", [](double v) { return std::asin(v); }, false},
+    {"acos", [](double v) { return std::acos(v); }, false},
+    {"atan", [](double v) { return std::atan(v); }, false},
+    {"sinh", [](double v) { return std::sinh(v); }, false},
+    {"cosh", [](double v) { return std::cosh(v); }, false},
+    {"tanh", [](double v) { return std::tanh(v); }, false},
+    {"asinh", [](double v) { return std::asinh(v); }, false},
+    {"acosh", [](double v) { return std::acosh(v); }, false},
+    {"atanh", [](double v) { return std::atanh(v); }, false},
+    {"exp", [](double v) { return std::exp(v); }, false},
+    {"ln", [](double v) { return std::log(v); }, false},
+    {"log10", [](double v) { return std::log10(v); }, false},
+    {"log2", [](double v) { return std::log2(v); }, false},
+    {"sqrt", [](double v) { return std::sqrt(v); }, false},
+    {"cbrt", [](double v) { return std::cbrt(v); }, false},
+    {"abs", [](double v) { return std::fabs(v); }, false},
+    {"floor", [](double v) { return std::floor(v); }, false},
+    {"ceil", [](double v) { return std::ceil(v); }, false},
+    {"trunc", [](double v) { return std::trunc(v); }, false},
+    {NULL},
+};
+
+static double lower_number(Number const& num) {
+    if (num.isPlusInfinity()) {
+        return std::numeric_limits<double>::infinity();
+    } else if (num.isMinusInfinity()) {
+        return -std::numeric_limits<double>::infinity();
+    } else {
+        return num.floatValue();
+    }
+}
+
+static bool matches(MathStructure const& expr, MathStructure const& arg) {
+    if (arg.isVariable()) {
+        return expr.isVariable() && expr.variable() == arg.variable();
+    } else if (arg.isSymbolic()) {
+        return expr.isSymbolic() && expr.symbol() == arg.symbol();
+    }
+    return false;
+}
+
+static bool is_compound(MathStructure const& expr) {
+    switch (expr.type()) {
+    case STRUCT_ADDITION:
+    case STRUCT_MULTIPLICATION:
+    case STRUCT_DIVISION:
+    case STRUCT_POWER:
+    case STRUCT_NEGATE:
+    case STRUCT_INVERSE:
+    case STRUCT_FUNCTION:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Program::emit(OpCode op, int arg, double value, double (*fn)(double)) {
+    code.push_back({op, arg, value, fn});
+
+    switch (op) {
+    case OP_CONST:
+    case OP_ARG:
+    case OP_LOAD:
+        stack_size++;
+        break;
+    case OP_ADD:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POW:
+        stack_size--;
+        break;
+    default:
+        break;
+    }
+
+    if (stack_size > max_stack) {
+        max_stack = stack_size;
+    }
+}
+
+bool Program::lower(MathStructure const& expr, std::vector<MathStructure> const& args, EvaluationOptions const& eo) {
+    return lower(std::vector<const MathStructure*>{&expr}, args, eo);
+}
+
+bool Program::lower(std::vector<const MathStructure*> const& exprs, std::vector<MathStructure> const& args,
+                    EvaluationOptions const& eo) {
+    code.clear();
+    stack_size = max_stack = temps = 0;
+    n_outputs = 0;
+    this->args = &args;
+    this->eo = &eo;
+
+    shared.clear();
+    for (const MathStructure* expr : exprs) {
+        count_node(*expr, 0);
+    }
+
+    // each output stays on the stack below the ones after it
+    bool ok = !exprs.empty();
+    for (size_t i = 0; ok && i < exprs.size(); i++) {
+        ok = lower_node(*exprs[i], 0);
+    }
+    ok = ok && max_stack <= PROGRAM_MAX_STACK;
+
+    this->args = NULL;
+    this->eo = NULL;
+    shared.clear();
+    if (ok) {
+        n_outputs = exprs.size();
+    } else {
+        code.clear();
+    }
+    return ok;
+}
+
+// Counts the uses of every compound subexpression, in the order lower_node visits them.
+// A repeated subexpression is not descended into again, its parts are evaluated once with it.
+void Program::count_node(MathStructure const& expr, int depth) {
+    if (depth > PROGRAM_MAX_DEPTH) {
+        return;
+    }
+    for (size_t i = 0; i < args->size(); i++) {
+        if (matches(expr, (*args)[i])) {
+            return;
+        }
+    }
+
+    if (expr.isVariable()) {
+        if (expr.variable()->isKnown()) {
+            count_node(((KnownVariable*)expr.variable())->get(), depth + 1);
+        }
+        return;
+    }
+    if (!is_compound(expr)) {
+        return;
+    }
+
+    for (Shared& node : shared) {
+        if (node.expr == &expr || node.expr->equals(expr)) {
+            node.uses++;
+            return;
+        }
+    }
+    if (shared.size() < PROGRAM_MAX_SHARED) {
+        shared.push_back({&expr, 1, -1});
+    }
+
+    for (size_t i = 0; i < expr.size(); i++) {
+        count_node(expr[i], depth + 1);
+    }
+}
+
+// lowers the first use of a repeated subexpression and keeps it in a temporary for the later ones
+bool Program::lower_node(MathStructure const& expr, int depth) {
+    Shared* repeated = NULL;
+    if (is_compound(expr)) {
+        for (Shared& node : shared) {
+            if (node.uses > 1 && (node.expr == &expr || node.expr->equals(expr))) {
+                repeated = &node;
+                break;
+            }
+        }
+    }
+
+    if (repeated && repeated->temp >= 0) {
+        emit(OP_LOAD, repeated->temp);
+        return true;
+    }
+    if (!lower_value(expr, depth)) {
+        return false;
+    }
+    if (repeated && temps < PROGRAM_MAX_TEMPS) {
+        repeated->temp = temps++;
+        emit(OP_STORE, repeated->temp);
+    }
+    return true;
+}
+
+bool Program::lower_value(MathStructure const& expr, int depth) {
+    if (depth > PROGRAM_MAX_DEPTH) {
+        return false;
+    }
+
+    for (size_t i = 0; i < args->size(); i++) {
+        if (matches(expr, (*args)[i])) {
+            emit(OP_ARG, i);
+            return true;
+        }
+    }
+
+    switch (expr.type()) {
+    case STRUCT_NUMBER:
+        if (expr.number().isComplex()) {
+            return false;
+        }
+        emit(OP_CONST, 0, lower_number(expr.number()));
+        return true;
+
+    case STRUCT_VARIABLE: {
+        Variable* var = expr.variable();
+        if (!var->isKnown()) {
+            return false;
+        }
+        return lower_node(((KnownVariable*)var)->get(), depth + 1);
+    }
+
+    case STRUCT_ADDITION:
+    case STRUCT_MULTIPLICATION:
+        if (expr.size() == 0) {
+            return false;
+        }
+        for (size_t i = 0; i < expr.size(); i++) {
+            if (!lower_node(expr[i], depth + 1)) {
+                return false;
+            }
+            if (i > 0) {
+                emit(expr.isAddition() ? OP_ADD : OP_MUL);
+            }
+        }
+        return true;
+
+    case STRUCT_DIVISION:
+    case STRUCT_POWER:
+        if (!lower_node(expr[0], depth + 1) || !lower_node(expr[1], depth + 1)) {
+            return false;
+        }
+        emit(expr.isDivision() ? OP_DIV : OP_POW);
+        return true;
+
+    case STRUCT_NEGATE:
+    case STRUCT_INVERSE:
+        if (!lower_node(expr[0], depth + 1)) {
+            return false;
+        }
+        emit(expr.isNegate() ? OP_NEG : OP_INV);
+        return true;
+
+    case STRUCT_FUNCTION: {
+        std::string const& name = expr.function()->referenceName();
+        bool radians = eo->parse_options.angle_unit == ANGLE_UNIT_NONE ||
+                       eo->parse_options.angle_unit == ANGLE_UNIT_RADIANS;
+
+        if (name == "log" && (expr.size() == 1 || expr.size() == 2)) {
+            // log(x, base), the base defaults to e
+            auto ln = [](double v) { return std::log(v); };
+            if (!lower_node(expr[0], depth + 1)) {
+                return false;
+            }
+            emit(OP_CALL, 0, 0, ln);
+            if (expr.size() == 2) {
+                if (!lower_node(expr[1], depth + 1)) {
+                    return false;
+                }
+                emit(OP_CALL, 0, 0, ln);
+                emit(OP_DIV);
+            }
+            return true;
+        }
+
+        if (expr.size() != 1) {
+            return false;
+        }
+        for (int i = 0; unary_functions[i].name; i++) {
+            if (name == unary_functions[i].name) {
+                if ((unary_functions[i].angle && !radians) || !lower_node(expr[0], depth + 1)) {
+                    return false;
+                }
+                emit(OP_CALL, 0, 0, unary_functions[i].fn);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    default:
+        return false;
+    }
+}
+
+double Program::run(const double* args) const {
+    double out[PROGRAM_MAX_STACK];
+    run(args, out);
+    return n_outputs > 0 ? out[0] : std::numeric_limits<double>::quiet_NaN();
+}
+
+void Program::run(const double* args, double* out) const {
+    double stack[PROGRAM_MAX_STACK];
+    double temp[PROGRAM_MAX_TEMPS];
+    int top = -1;
+
+    for (Instruction const& ins : code) {
+        switch (ins.op) {
+        case OP_CONST:
+            stack[++top] = ins.value;
+            break;
+        case OP_ARG:
+            stack[++top] = args[ins.arg];
+            break;
+        case OP_LOAD:
+            stack[++top] = temp[ins.arg];
+            break;
+        case OP_STORE:
+            temp[ins.arg] = stack[top];
+            break;
+        case OP_ADD:
+            top--;
+            stack[top] += stack[top + 1];
+            break;
+        case OP_MUL:
+            top--;
+            stack[top] *= stack[top + 1];
+            break;
+        case OP_DIV:
+            top--;
+            stack[top] /= stack[top + 1];
+            break;
+        case OP_POW:
+            top--;
+            stack[top] = std::pow(stack[top], stack[top + 1]);
+            break;
+        case OP_NEG:
+            stack[top] = -stack[top];
+            break;
+        case OP_INV:
+            stack[top] = 1 / stack[top];
+            break;
+        case OP_CALL:
+            stack[top] = ins.fn(stack[top]);
+            break;
+        }
+    }
+
+    bool ok = n_outputs > 0 && top + 1 == (int)n_outputs;
+    for (size_t k = 0; k < n_outputs; k++) {
+        out[k] = ok ? stack[k] : std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+void Program::run_batch(const double* const* args, double* out, size_t n) const {
+    double* outs[] = {out};
+    run_columns(args, outs, 1, n);
+}
+
+void Program::run_batch(const double* const* args, double* const* out, size_t n) const {
+    run_columns(args, out, n_outputs, n);
+}
+
+// writes the first n_out outputs
+void Program::run_columns(const double* const* args, double* const* out, size_t n_out, size_t n) const {
+    std::vector<double> columns((max_stack > 0 ? max_stack : 1) * PROGRAM_BLOCK);
+    std::vector<double> temp_columns(temps * PROGRAM_BLOCK);
+
+    for (size_t base = 0; base < n; base += PROGRAM_BLOCK) {
+        size_t len = std::min<size_t>(PROGRAM_BLOCK, n - base);
+        int top = -1;
+
+        for (Instruction const& ins : code) {
+            bool pushes = ins.op == OP_CONST || ins.op == OP_ARG || ins.op == OP_LOAD;
+            // a is the top of the stack (or the new top), b the value below it
+            double* a = &columns[(pushes ? top + 1 : top) * PROGRAM_BLOCK];
+            double* b = top > 0 ? &columns[(top - 1) * PROGRAM_BLOCK] : NULL;
+
+            switch (ins.op) {
+            case OP_CONST:
+                std::fill(a, a + len, ins.value);
+                top++;
+                break;
+            case OP_ARG:
+                std::copy(args[ins.arg] + base, args[ins.arg] + base + len, a);
+                top++;
+                break;
+            case OP_LOAD: {
+                double* t = &temp_columns[ins.arg * PROGRAM_BLOCK];
+                std::copy(t, t + len, a);
+                top++;
+                break;
+            }
+            case OP_STORE:
+                std::copy(a, a + len, &temp_columns[ins.arg * PROGRAM_BLOCK]);
+                break;
+            case OP_ADD:
+                for (size_t i = 0; i < len; i++) {
+                    b[i] += a[i];
+                }
+                top--;
+                break;
+            case OP_MUL:
+                for (size_t i = 0; i < len; i++) {
+                    b[i] *= a[i];
+                }
+                top--;
+                break;
+            case OP_DIV:
+                for (size_t i = 0; i < len; i++) {
+                    b[i] /= a[i];
+                }
+                top--;
+                break;
+            case OP_POW:
+                for (size_t i = 0; i < len; i++) {
+                    b[i] = std::pow(b[i], a[i]);
+                }
+                top--;
+                break;
+            case OP_NEG:
+                for (size_t i = 0; i < len; i++) {
+                    a[i] = -a[i];
+                }
+                break;
+            case OP_INV:
+                for (size_t i = 0; i < len; i++) {
+                    a[i] = 1 / a[i];
+                }
+                break;
+            case OP_CALL:
+                for (size_t i = 0; i < len; i++) {
+                    a[i] = ins.fn(a[i]);
+                }
+                break;
+            }
+        }
+
+        bool ok = n_outputs > 0 && top + 1 == (int)n_outputs;
+        for (size_t k = 0; k < n_out; k++) {
+            if (ok && k < n_outputs) {
+                std::copy(&columns[k * PROGRAM_BLOCK], &columns[k * PROGRAM_BLOCK] + len, out[k] + base);
+            } else {
+                std::fill(out[k] + base, out[k] + base + len, std::numeric_limits<double>::quiet_NaN());
+            }
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <libqalculate/MathStructure.h>
+#include <libqalculate/includes.h>
+#include <vector>
+
+// A MathStructure lowered to a stack machine over doubles, for expressions
+// that only use arithmetic and elementary functions of real arguments.
+class Program {
+  public:
+    // args[i] is the variable or symbol that the i-th argument replaces.
+    // Returns false if expr has no double precision equivalent.
+    bool lower(MathStructure const& expr, std::vector<MathStructure> const& args, EvaluationOptions const& eo);
+
+    // One output per expression. Subexpressions that occur more than once,
+    // in one expression or across several, are evaluated once per point.
+    bool lower(std::vector<const MathStructure*> const& exprs, std::vector<MathStructure> const& args,
+               EvaluationOptions const& eo);
+
+    size_t outputs() const { return n_outputs; }
+
+    // the first output
+    double run(const double* args) const;
+    // every output into out[0], out[1], ...
+    void run(const double* args, double* out) const;
+
+    // out[i] = run({args[0][i], args[1][i], ...}) for i < n,
+    // evaluated a block of points at a time so the arithmetic vectorizes
+    void run_batch(const double* const* args, double* out, size_t n) const;
+    // out[k][i] is output k at point i
+    void run_batch(const double* const* args, double* const* out, size_t n) const;
+
+  private:
+    enum OpCode {
+        OP_CONST,
+        OP_ARG,
+        OP_ADD,
+        OP_MUL,
+        OP_DIV,
+        OP_POW,
+        OP_NEG,
+        OP_INV,
+        OP_CALL,
+        OP_LOAD,  // push temporary arg
+        OP_STORE, // copy the top of the stack to temporary arg
+    };
+
+    struct Instruction {
+        OpCode op;
+        int arg;
+        double value;
+        double (*fn)(double);
+    };
+
+    struct Shared {
+        const MathStructure* expr;
+        int uses;
+        int temp; // -1 until the first use has been lowered
+    };
+
+    void count_node(MathStructure const& expr, int depth);
+    bool lower_node(MathStructure const& expr, int depth);
+    bool lower_value(MathStructure const& expr, int depth);
+    void emit(OpCode op, int arg = 0, double value = 0, double (*fn)(double) = NULL);
+    void run_columns(const double* const* args, double* const* out, size_t n_out, size_t n) const;
+
+    std::vector<Instruction> code;
+    int stack_size = 0;
+    int max_stack = 0;
+    int temps = 0;
+    size_t n_outputs = 0;
+
+    std::vector<MathStructure> const* args;
+    EvaluationOptions const* eo;
+    std::vector<Shared> shared;
+};
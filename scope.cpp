@@ -0,0 +1,98 @@
+#include "scope.hpp"
+#include "util.hpp"
+
+VariableScope::VariableScope(Calculator* calc) : calc(calc) {}
+
+VariableScope::~VariableScope() { clear(); }
+
+void VariableScope::shadow(Variable* var) {
+    Variable* other = calc->getActiveVariable(var->referenceName());
+    if (other && other != var) {
+        other->setActive(false);
+        shadowed.push_back(other);
+    }
+}
+
+void VariableScope::activate() {
+    if (active) {
+        return;
+    }
+
+    for (Variable* var : variables) {
+        shadow(var);
+        var->setActive(true);
+    }
+    active = true;
+}
+
+void VariableScope::deactivate() {
+    if (!active) {
+        return;
+    }
+
+    for (Variable* var : variables) {
+        var->setActive(false);
+    }
+    for (Variable* var : shadowed) {
+        var->setActive(true);
+    }
+    shadowed.clear();
+    active = false;
+}
+
+Variable* VariableScope::find(std::string const& name) const {
+    for (Variable* var : variables) {
+        if (var->referenceName() == name) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+void VariableScope::add(Variable* var) {
+    if (active) {
+        shadow(var);
+    } else {
+        var->setActive(false);
+    }
+
+    calc->addVariable(var);
+    variables.push_back(var);
+}
+
+void VariableScope::adopt(size_t first) {
+    for (size_t i = first; i < calc->variables.size(); i++) {
+        variables.push_back(calc->variables[i]);
+    }
+}
+
+void VariableScope::remove(std::string const& name) {
+    for (size_t i = 0; i < variables.size(); i++) {
+        if (variables[i]->referenceName() != name) {
+            continue;
+        }
+
+        if (active) {
+            for (size_t k = 0; k < shadowed.size(); k++) {
+                if (shadowed[k]->referenceName() == name) {
+                    shadowed[k]->setActive(true);
+                    shadowed.erase(shadowed.begin() + k);
+                    break;
+                }
+            }
+        }
+        destroy_ExpressionItem(calc, variables[i]);
+        variables.erase(variables.begin() + i);
+        return;
+    }
+}
+
+void VariableScope::clear() {
+    bool was_active = active;
+    deactivate();
+    for (Variable* var : variables) {
+        destroy_ExpressionItem(calc, var);
+    }
+    variables.clear();
+    active = was_active;
+}
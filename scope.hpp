@@ -0,0 +1,45 @@
+#pragma once
+
+#include <libqalculate/Calculator.h>
+#include <libqalculate/Variable.h>
+#include <string>
+#include <vector>
+
+// The variables one calculator handle defined in a Calculator that it shares
+// with other handles. Only one scope per Calculator should be active at a time,
+// the variables of all others are deactivated.
+class VariableScope {
+  public:
+    VariableScope(Calculator* calc);
+    // destroys the variables, call with the calculator locked
+    ~VariableScope();
+
+    void activate();
+    void deactivate();
+
+    // one of this scope's variables, nullable
+    Variable* find(std::string const& name) const;
+
+    // registers a new variable with the calculator and hides
+    // any other active variable of the same name
+    void add(Variable* var);
+
+    // takes over the variables an assignment appended to calc->variables
+    void adopt(size_t first);
+
+    // unregisters this scope's variable of that name, if any
+    void remove(std::string const& name);
+
+    // unregisters all variables from the calculator, libqalculate deletes
+    // them once no expression refers to them anymore
+    void clear();
+
+  private:
+    void shadow(Variable* var);
+
+    Calculator* calc;
+    bool active = false;
+    std::vector<Variable*> variables;
+    // variables of the same name as ours, to restore on deactivation
+    std::vector<Variable*> shadowed;
+};
@@ -0,0 +1,471 @@
+#include "serialize.hpp"
+
+#include <libqalculate/ExpressionItem.h>
+#include <libqalculate/Function.h>
+#include <libqalculate/Number.h>
+#include <libqalculate/Prefix.h>
+#include <libqalculate/Unit.h>
+#include <libqalculate/Variable.h>
+#include <cstring>
+#include <gmp.h>
+#include <mpfr.h>
+
+// deeper data is treated as malformed
+#define SERIALIZE_MAX_DEPTH 1024
+// bits, higher precisions are treated as malformed
+#define SERIALIZE_MAX_PRECISION (1 << 24)
+
+enum NumberKind {
+    NUMBER_RATIONAL,
+    NUMBER_FLOAT,
+    NUMBER_COMPLEX,
+    NUMBER_PLUS_INFINITY,
+    NUMBER_MINUS_INFINITY,
+};
+
+// what one bound of a floating point number holds
+enum FloatClass {
+    FLOAT_REGULAR,
+    FLOAT_ZERO,
+    FLOAT_NEGATIVE_ZERO,
+    FLOAT_NAN,
+    FLOAT_PLUS_INFINITY,
+    FLOAT_MINUS_INFINITY,
+};
+
+enum StructureFlag {
+    FLAG_APPROXIMATE = 1,
+    FLAG_PRECISION = 2,
+};
+
+void write_varint(std::string& out, unsigned long value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+bool read_varint(std::string_view& in, unsigned long& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in.empty()) {
+            return false;
+        }
+        unsigned char byte = in.front();
+        in.remove_prefix(1);
+        value |= (unsigned long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void write_string(std::string& out, std::string const& str) {
+    write_varint(out, str.size());
+    out += str;
+}
+
+static bool read_string(std::string_view& in, std::string& str) {
+    unsigned long len;
+    if (!read_varint(in, len) || len > in.size()) {
+        return false;
+    }
+    str.assign(in.data(), len);
+    in.remove_prefix(len);
+    return true;
+}
+
+static bool read_byte(std::string_view& in, int& byte) {
+    if (in.empty()) {
+        return false;
+    }
+    byte = (unsigned char)in.front();
+    in.remove_prefix(1);
+    return true;
+}
+
+// base 62 digits, the most mpz_get_str has
+static void write_mpz(std::string& out, mpz_srcptr value) {
+    std::string digits(mpz_sizeinbase(value, 62) + 2, '\0');
+    mpz_get_str(&digits[0], 62, value);
+    digits.resize(strlen(digits.c_str()));
+    write_string(out, digits);
+}
+
+static bool read_mpz(std::string_view& in, mpz_ptr value) {
+    std::string digits;
+    return read_string(in, digits) && mpz_set_str(value, digits.c_str(), 62) == 0;
+}
+
+// the precision, then for regular values the significand as an integer and the binary exponent
+static void write_mpfr(std::string& out, mpfr_srcptr value) {
+    write_varint(out, mpfr_get_prec(value));
+    if (mpfr_nan_p(value)) {
+        out.push_back(FLOAT_NAN);
+    } else if (mpfr_inf_p(value)) {
+        out.push_back(mpfr_signbit(value) ? FLOAT_MINUS_INFINITY : FLOAT_PLUS_INFINITY);
+    } else if (mpfr_zero_p(value)) {
+        out.push_back(mpfr_signbit(value) ? FLOAT_NEGATIVE_ZERO : FLOAT_ZERO);
+    } else {
+        out.push_back(FLOAT_REGULAR);
+        mpz_t significand;
+        mpz_init(significand);
+        long exp = mpfr_get_z_2exp(significand, value);
+        write_mpz(out, significand);
+        mpz_clear(significand);
+        // zigzag encoded, so small negative exponents stay short
+        write_varint(out, ((unsigned long)exp << 1) ^ (unsigned long)(exp >> 63));
+    }
+}
+
+// initializes value, which the caller clears if this returns true
+static bool read_mpfr(std::string_view& in, mpfr_ptr value) {
+    unsigned long prec;
+    int kind;
+    if (!read_varint(in, prec) || prec < MPFR_PREC_MIN || prec > SERIALIZE_MAX_PRECISION || !read_byte(in, kind)) {
+        return false;
+    }
+
+    mpfr_init2(value, prec);
+    bool ok = true;
+    switch (kind) {
+    case FLOAT_REGULAR: {
+        mpz_t significand;
+        mpz_init(significand);
+        unsigned long zigzag;
+        // a wider significand would be rounded
+        ok = read_mpz(in, significand) && mpz_sizeinbase(significand, 2) <= prec && read_varint(in, zigzag);
+        if (ok) {
+            long exp = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+            mpfr_set_z_2exp(value, significand, exp, MPFR_RNDN);
+        }
+        mpz_clear(significand);
+        break;
+    }
+    case FLOAT_ZERO:
+    case FLOAT_NEGATIVE_ZERO:
+        mpfr_set_zero(value, kind == FLOAT_ZERO ? 1 : -1);
+        break;
+    case FLOAT_NAN:
+        mpfr_set_nan(value);
+        break;
+    case FLOAT_PLUS_INFINITY:
+    case FLOAT_MINUS_INFINITY:
+        mpfr_set_inf(value, kind == FLOAT_PLUS_INFINITY ? 1 : -1);
+        break;
+    default:
+        ok = false;
+    }
+
+    if (!ok) {
+        mpfr_clear(value);
+    }
+    return ok;
+}
+
+static bool write_Number(std::string& out, Number const& num) {
+    int flags = (num.isApproximate() ? FLAG_APPROXIMATE : 0) | (num.precision() >= 0 ? FLAG_PRECISION : 0);
+
+    if (num.isComplex()) {
+        out.push_back(NUMBER_COMPLEX);
+        return write_Number(out, num.realPart()) && write_Number(out, num.imaginaryPart());
+    } else if (num.isUndefined()) {
+        return false;
+    } else if (num.isPlusInfinity()) {
+        out.push_back(NUMBER_PLUS_INFINITY);
+        return true;
+    } else if (num.isMinusInfinity()) {
+        out.push_back(NUMBER_MINUS_INFINITY);
+        return true;
+    } else if (num.isRational()) {
+        out.push_back(NUMBER_RATIONAL);
+        write_mpz(out, mpq_numref(num.internalRational()));
+        write_mpz(out, mpq_denref(num.internalRational()));
+    } else {
+        // both bounds, which are the same unless num is an interval
+        out.push_back(NUMBER_FLOAT);
+        write_mpfr(out, num.internalLowerFloat());
+        write_mpfr(out, num.internalUpperFloat());
+    }
+
+    out.push_back(flags);
+    if (flags & FLAG_PRECISION) {
+        write_varint(out, num.precision());
+    }
+    return true;
+}
+
+static bool read_Number(std::string_view& in, Number& num) {
+    int kind;
+    if (!read_byte(in, kind)) {
+        return false;
+    }
+
+    switch (kind) {
+    case NUMBER_COMPLEX: {
+        Number imag;
+        if (!read_Number(in, num) || !read_Number(in, imag)) {
+            return false;
+        }
+        num.setImaginaryPart(imag);
+        return true;
+    }
+    case NUMBER_PLUS_INFINITY:
+        num.setPlusInfinity();
+        return true;
+    case NUMBER_MINUS_INFINITY:
+        num.setMinusInfinity();
+        return true;
+    case NUMBER_RATIONAL: {
+        mpq_t value;
+        mpq_init(value);
+        bool ok = read_mpz(in, mpq_numref(value)) && read_mpz(in, mpq_denref(value)) &&
+                  mpz_sgn(mpq_denref(value)) != 0;
+        if (ok) {
+            mpq_canonicalize(value);
+            num.setInternal(value);
+        }
+        mpq_clear(value);
+        if (!ok) {
+            return false;
+        }
+        break;
+    }
+    case NUMBER_FLOAT: {
+        mpfr_t lower, upper;
+        if (!read_mpfr(in, lower)) {
+            return false;
+        }
+        if (!read_mpfr(in, upper)) {
+            mpfr_clear(lower);
+            return false;
+        }
+        if (mpfr_equal_p(lower, upper) || (mpfr_nan_p(lower) && mpfr_nan_p(upper))) {
+            num.setInternal(lower);
+        } else {
+            Number lower_bound, upper_bound;
+            lower_bound.setInternal(lower);
+            upper_bound.setInternal(upper);
+            num.setInterval(lower_bound, upper_bound);
+        }
+        mpfr_clear(lower);
+        mpfr_clear(upper);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    int flags;
+    if (!read_byte(in, flags)) {
+        return false;
+    }
+    if (flags & FLAG_APPROXIMATE) {
+        num.setApproximate();
+    }
+    if (flags & FLAG_PRECISION) {
+        unsigned long precision;
+        if (!read_varint(in, precision)) {
+            return false;
+        }
+        num.setPrecision(precision);
+    }
+    return true;
+}
+
+static bool write_node(std::string& out, MathStructure const& expr) {
+    out.push_back(expr.type());
+    int flags = (expr.isApproximate() ? FLAG_APPROXIMATE : 0) | (expr.precision() >= 0 ? FLAG_PRECISION : 0);
+    out.push_back(flags);
+    if (flags & FLAG_PRECISION) {
+        write_varint(out, expr.precision());
+    }
+
+    switch (expr.type()) {
+    case STRUCT_NUMBER:
+        return write_Number(out, expr.number());
+    case STRUCT_SYMBOLIC:
+        write_string(out, expr.symbol());
+        return true;
+    case STRUCT_VARIABLE:
+        write_string(out, expr.variable()->referenceName());
+        return true;
+    case STRUCT_UNIT:
+        write_string(out, expr.unit()->referenceName());
+        write_string(out, expr.prefix() ? expr.prefix()->referenceName() : "");
+        return true;
+    case STRUCT_UNDEFINED:
+    case STRUCT_ABORTED:
+        return true;
+    case STRUCT_DATETIME:
+        return false;
+    case STRUCT_FUNCTION:
+        write_string(out, expr.function()->referenceName());
+        break;
+    case STRUCT_COMPARISON:
+        out.push_back(expr.comparisonType());
+        break;
+    default:
+        break;
+    }
+
+    write_varint(out, expr.size());
+    for (size_t i = 0; i < expr.size(); i++) {
+        if (!write_node(out, expr[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool write_MathStructure(std::string& out, MathStructure const& expr) { return write_node(out, expr); }
+
+static bool read_node(std::string_view& in, Calculator* calc, MathStructure& expr, int depth) {
+    int type, flags;
+    unsigned long precision = 0;
+    if (depth > SERIALIZE_MAX_DEPTH || !read_byte(in, type) || !read_byte(in, flags) ||
+        ((flags & FLAG_PRECISION) && !read_varint(in, precision))) {
+        return false;
+    }
+
+    std::string name;
+    switch (type) {
+    case STRUCT_NUMBER: {
+        Number num;
+        if (!read_Number(in, num)) {
+            return false;
+        }
+        expr.set(num);
+        break;
+    }
+    case STRUCT_SYMBOLIC:
+        if (!read_string(in, name)) {
+            return false;
+        }
+        expr.setSymbol(name);
+        break;
+    case STRUCT_VARIABLE: {
+        Variable* var = read_string(in, name) ? calc->getActiveVariable(name) : NULL;
+        if (!var) {
+            return false;
+        }
+        expr.setVariable(var);
+        break;
+    }
+    case STRUCT_UNIT: {
+        std::string prefix_name;
+        Unit* unit = read_string(in, name) ? calc->getActiveUnit(name) : NULL;
+        if (!unit || !read_string(in, prefix_name)) {
+            return false;
+        }
+        Prefix* prefix = NULL;
+        if (!prefix_name.empty() && !(prefix = calc->getPrefix(prefix_name))) {
+            return false;
+        }
+        expr = MathStructure(unit, prefix);
+        break;
+    }
+    case STRUCT_UNDEFINED:
+        expr.setUndefined();
+        break;
+    case STRUCT_ABORTED:
+        expr.setAborted();
+        break;
+    case STRUCT_FUNCTION: {
+        MathFunction* fn = read_string(in, name) ? calc->getActiveFunction(name) : NULL;
+        if (!fn) {
+            return false;
+        }
+        expr.setFunction(fn);
+        break;
+    }
+    case STRUCT_COMPARISON: {
+        int comparison;
+        if (!read_byte(in, comparison) || comparison > COMPARISON_NOT_EQUALS) {
+            return false;
+        }
+        expr.clear();
+        expr.setType(STRUCT_COMPARISON);
+        expr.setComparisonType((ComparisonType)comparison);
+        break;
+    }
+    case STRUCT_VECTOR:
+        expr.clearVector();
+        break;
+    case STRUCT_MULTIPLICATION:
+    case STRUCT_INVERSE:
+    case STRUCT_DIVISION:
+    case STRUCT_ADDITION:
+    case STRUCT_NEGATE:
+    case STRUCT_POWER:
+    case STRUCT_BITWISE_AND:
+    case STRUCT_BITWISE_OR:
+    case STRUCT_BITWISE_XOR:
+    case STRUCT_BITWISE_NOT:
+    case STRUCT_LOGICAL_AND:
+    case STRUCT_LOGICAL_OR:
+    case STRUCT_LOGICAL_XOR:
+    case STRUCT_LOGICAL_NOT:
+        expr.clear();
+        expr.setType((StructureType)type);
+        break;
+    default:
+        return false;
+    }
+
+    bool has_children = type != STRUCT_NUMBER && type != STRUCT_SYMBOLIC && type != STRUCT_VARIABLE &&
+                        type != STRUCT_UNIT && type != STRUCT_UNDEFINED && type != STRUCT_ABORTED;
+    if (has_children) {
+        unsigned long count;
+        // every child takes at least two bytes
+        if (!read_varint(in, count) || count > in.size() / 2) {
+            return false;
+        }
+        for (unsigned long i = 0; i < count; i++) {
+            MathStructure child;
+            if (!read_node(in, calc, child, depth + 1)) {
+                return false;
+            }
+            expr.addChild(child);
+        }
+    }
+
+    if (flags & FLAG_APPROXIMATE) {
+        expr.setApproximate();
+    }
+    if (flags & FLAG_PRECISION) {
+        expr.setPrecision(precision);
+    }
+    return true;
+}
+
+bool read_MathStructure(std::string_view& in, Calculator* calc, MathStructure& expr) {
+    return read_node(in, calc, expr, 0);
+}
+
+void write_MessageList(std::string& out, MessageList const& messages) {
+    write_varint(out, messages.size());
+    for (auto const& [text, type] : messages) {
+        write_string(out, text);
+        out.push_back(type);
+    }
+}
+
+bool read_MessageList(std::string_view& in, MessageList& messages) {
+    unsigned long count;
+    if (!read_varint(in, count) || count > in.size()) {
+        return false;
+    }
+    messages.clear();
+    for (unsigned long i = 0; i < count; i++) {
+        std::string text;
+        int type;
+        if (!read_string(in, text) || !read_byte(in, type)) {
+            return false;
+        }
+        messages.push_back({text, type});
+    }
+    return true;
+}
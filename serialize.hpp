@@ -0,0 +1,30 @@
+#pragma once
+
+#include <libqalculate/Calculator.h>
+#include <libqalculate/MathStructure.h>
+#include <libqalculate/includes.h>
+#include <string>
+#include <string_view>
+
+#include "util.hpp"
+
+// A compact binary form of MathStructures, to keep results on disk.
+// Variables, units, prefixes and functions are written by name and looked up
+// again in the calculator that reads them, which needs the same definitions.
+// Numbers are exact: rationals as their GMP numerator and denominator, floats
+// and intervals as the MPFR significand, exponent and precision of both bounds.
+
+// Appends expr to out. Returns false if it contains something that has no
+// binary form (dates, undefined numbers), out is left with a partial record then.
+bool write_MathStructure(std::string& out, MathStructure const& expr);
+
+// Reads one structure from the front of in and advances past it.
+// Returns false if the data is malformed or names something calc doesn't know.
+bool read_MathStructure(std::string_view& in, Calculator* calc, MathStructure& expr);
+
+void write_MessageList(std::string& out, MessageList const& messages);
+bool read_MessageList(std::string_view& in, MessageList& messages);
+
+// unsigned LEB128, shared with other binary records
+void write_varint(std::string& out, unsigned long value);
+bool read_varint(std::string_view& in, unsigned long& value);
@@ -0,0 +1,58 @@
+#include "sheet.hpp"
+
+#include <libqalculate/Calculator.h>
+#include <algorithm>
+#include <cctype>
+
+static bool is_name_start(unsigned char c) { return std::isalpha(c) || c == '_' || c >= 0x80; }
+
+static bool is_name_char(unsigned char c) { return is_name_start(c) || std::isdigit(c); }
+
+// appends the identifiers in str to names, skipping numbers and quoted text
+static void collect_names(std::string const& str, std::vector<std::string>& names) {
+    size_t i = 0;
+    while (i < str.size()) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\'') {
+            size_t end = str.find(c, i + 1);
+            i = end == std::string::npos ? str.size() : end + 1;
+        } else if (std::isdigit(c)) {
+            while (i < str.size() && (std::isdigit((unsigned char)str[i]) || str[i] == '.')) {
+                i++;
+            }
+        } else if (is_name_start(c)) {
+            size_t start = i;
+            while (i < str.size() && is_name_char(str[i])) {
+                i++;
+            }
+            names.push_back(str.substr(start, i - start));
+        } else {
+            i++;
+        }
+    }
+
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+}
+
+LineNames analyze_line(std::string text, ParseOptions const& po, bool do_assignment) {
+    LineNames res;
+    if (do_assignment) {
+        transform_expression_for_equals_save(text, po);
+    }
+
+    size_t assign = text.find(":=");
+    if (assign == std::string::npos) {
+        collect_names(text, res.reads);
+        return res;
+    }
+
+    // "x := ..." defines x, "f(x) := ..." defines f
+    std::vector<std::string> lhs;
+    collect_names(text.substr(0, std::min(assign, text.find('('))), lhs);
+    if (lhs.size() == 1) {
+        res.defines = lhs;
+    }
+    collect_names(text.substr(assign + 2), res.reads);
+    return res;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <libqalculate/includes.h>
+#include <string>
+#include <vector>
+
+// the names a line of a QalcSheet defines and reads
+struct LineNames {
+    std::vector<std::string> defines;
+    // every identifier the line reads, a superset of the variables and functions it depends on
+    std::vector<std::string> reads;
+};
+
+// finds the names in text as eval(text, po, do_assignment) would see it, without parsing
+LineNames analyze_line(std::string text, ParseOptions const& po, bool do_assignment);
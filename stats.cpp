@@ -0,0 +1,13 @@
+#include "stats.hpp"
+
+const char* const stat_phase_names[STAT_PHASE_COUNT] = {
+    "options", "eval", "calculate", "print", "value", "source", "as_matrix", "plot_callback",
+};
+
+void Stats::reset() {
+    for (Phase& p : phases) {
+        p = {};
+    }
+    math_structures = 0;
+    lua_objects = 0;
+}
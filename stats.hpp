@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <stddef.h>
+
+enum StatPhase {
+    STAT_OPTIONS,   // decoding option tables
+    STAT_EVAL,      // all of eval
+    STAT_CALCULATE, // Calculator::calculate in eval, including parsing
+    STAT_PRINT,
+    STAT_VALUE,
+    STAT_SOURCE,
+    STAT_AS_MATRIX,
+    STAT_PLOT_CALLBACK, // calling the Lua plot handler, including building its arguments
+    STAT_PHASE_COUNT,
+};
+
+extern const char* const stat_phase_names[STAT_PHASE_COUNT];
+
+// Counters and timings of one calculator, only recorded while enabled.
+// Not thread safe, only record on the thread owning the lua_State.
+struct Stats {
+    struct Phase {
+        unsigned long calls;
+        std::chrono::nanoseconds total;
+        std::chrono::nanoseconds max;
+    };
+
+    bool enabled = false;
+    Phase phases[STAT_PHASE_COUNT] = {};
+    unsigned long math_structures = 0; // allocated by the bindings, not inside libqalculate
+    unsigned long lua_objects = 0;     // tables, userdata and strings created
+
+    void reset();
+
+    void add_objects(unsigned long structures, unsigned long lua) {
+        if (enabled) {
+            math_structures += structures;
+            lua_objects += lua;
+        }
+    }
+};
+
+// times the scope it lives in as one call of phase, if stats are enabled
+class StatTimer {
+  public:
+    StatTimer(Stats* stats, StatPhase phase) : stats(stats && stats->enabled ? stats : NULL), phase(phase) {
+        if (this->stats) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StatTimer() {
+        if (stats) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            Stats::Phase& p = stats->phases[phase];
+            p.calls++;
+            p.total += elapsed;
+            if (elapsed > p.max) {
+                p.max = elapsed;
+            }
+        }
+    }
+
+  private:
+    Stats* stats;
+    StatPhase phase;
+    std::chrono::steady_clock::time_point start;
+};
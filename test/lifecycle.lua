@@ -0,0 +1,108 @@
+-- Checks that calculators and shared handles are freed once collected.
+--   luajit test/lifecycle.lua [scale]
+-- Creates thousands of them in rounds and fails if the resident memory keeps
+-- growing from one round to the next. scale multiplies the counts (default 1).
+package.cpath = "./lua/?.so;" .. package.cpath
+
+local qalc = require("qalculate.qalc")
+
+-- VmRSS of this process in kB
+local function rss()
+    local f = assert(io.open("/proc/self/status"))
+    for line in f:lines() do
+        local kb = line:match("^VmRSS:%s+(%d+) kB")
+        if kb then
+            f:close()
+            return tonumber(kb)
+        end
+    end
+    f:close()
+    error("no VmRSS in /proc/self/status")
+end
+
+local function settle()
+    collectgarbage()
+    collectgarbage()
+    return rss()
+end
+
+local scale = tonumber(arg[1]) or 1
+local failed = false
+
+-- what one calculator with its definitions costs while alive, to judge growth against
+local function cost_per_calculator()
+    local before = settle()
+    local alive = {}
+    for i = 1, 10 do
+        alive[i] = qalc.new(nil, { exchange_rates = false })
+        alive[i]:eval("1")
+    end
+    local after = rss()
+    alive = nil
+    settle()
+    return math.max(1, math.floor((after - before) / 10))
+end
+
+-- runs fn rounds * per_round times, after a first round that warms up the allocator.
+-- Fails if the rounds after it grew by more than limit_kb per call.
+local function check(name, rounds, per_round, fn, limit_kb)
+    per_round = math.max(1, math.floor(per_round * scale))
+    for i = 1, per_round do
+        fn(i)
+    end
+    local start = settle()
+
+    for round = 1, rounds do
+        for i = 1, per_round do
+            fn(i)
+        end
+    end
+    local grown = settle() - start
+    local per_call = grown / (rounds * per_round)
+
+    local ok = per_call <= limit_kb
+    failed = failed or not ok
+    print(("%-4s %-36s %6d calls, %8d kB grown, %8.3f kB per call"):format(
+        ok and "ok" or "FAIL",
+        name,
+        rounds * per_round,
+        grown,
+        per_call
+    ))
+end
+
+-- a leaked calculator shows up as about one calculator per call, leaked handles and variables as a few kB
+local unit_kb = cost_per_calculator()
+print(("one calculator costs about %d kB"):format(unit_kb))
+local calculator_limit = unit_kb / 20
+local variable_limit = 0.5
+
+check("calculator", 4, 250, function()
+    qalc.new(nil, { exchange_rates = false }):eval("x := 2")
+end, calculator_limit)
+
+-- the calculator has to outlive its handle while an expression refers to it
+local kept
+check("expression outliving its calculator", 4, 250, function()
+    kept = qalc.new(nil, { exchange_rates = false }):eval("sqrt(8) m")
+end, calculator_limit)
+kept = nil
+
+check("lazy calculator, never used", 4, 1000, function()
+    qalc.new(nil, { definitions = "lazy" })
+end, variable_limit)
+
+-- shared handles only add their scope's variables to the one shared calculator
+local shared = qalc.new(nil, { shared = true })
+check("shared handle", 4, 1000, function(i)
+    local calc = qalc.new(nil, { shared = true })
+    calc:set("v", i)
+    calc:eval("w := v + 1")
+end, variable_limit)
+
+check("shared reset and set", 4, 1000, function(i)
+    shared:reset(true)
+    shared:set("v", i)
+end, variable_limit)
+
+os.exit(failed and 1 or 0)
@@ -1,5 +1,14 @@
+#pragma once
+
+#include <cmath>
+#include <libqalculate/Calculator.h>
+#include <libqalculate/ExpressionItem.h>
+#include <libqalculate/Number.h>
 #include <lua5.1/lua.hpp>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 static inline void push_cppstr(lua_State* L, const std::string& str) { lua_pushlstring(L, str.data(), str.size()); }
 
@@ -9,3 +18,39 @@ static inline std::string check_cppstr(lua_State* L, int index) {
     return std::string(str, len);
 }
 
+// libqalculate reaches the current calculator and some of its own state through globals,
+// so only one thread may use any of the calculators at a time. Recursive, as a plot
+// handler runs with it held and may use another calculator. Timed, see AsyncEvaluator.
+typedef std::recursive_timed_mutex QalculateMutex;
+
+// message text and libqalculate MessageType
+typedef std::vector<std::pair<std::string, int>> MessageList;
+
+static inline MessageList collect_messages(Calculator* calc) {
+    MessageList messages;
+    while (auto msg = calc->message()) {
+        messages.push_back({msg->message(), msg->type()});
+        calc->nextMessage();
+    }
+    return messages;
+}
+
+// Unregisters item from calc, it is deleted once no structure refers to it anymore.
+// destroy() unregisters from the CALCULATOR global, which need not be calc.
+static inline void destroy_ExpressionItem(Calculator* calc, ExpressionItem* item) {
+    Calculator* current = CALCULATOR;
+    CALCULATOR = calc;
+    item->destroy();
+    CALCULATOR = current;
+}
+
+// integers stay exact, everything else becomes an approximate float
+static inline Number double_Number(double value) {
+    if (std::floor(value) == value && std::fabs(value) < 1e15) {
+        return Number((long)value);
+    }
+
+    Number num;
+    num.setFloat(value);
+    return num;
+}